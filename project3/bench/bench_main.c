@@ -0,0 +1,144 @@
+/**************************
+ * Kernel benchmarks, and checks of kernel behaviour that only show on the
+ * target. Results are printed on uart0 (9600 baud).
+ *
+ * Timer 5 free runs at the CPU clock, so a TCNT5 difference is a cycle
+ * count (62.5ns each). It wraps every 4ms, which is plenty for anything
+ * measured here.
+ *************************/
+
+#include <avr/interrupt.h>
+#include "../os/common.h"
+#include "../os/os.h"
+
+#define ROUNDS 200
+#define SMALL_STACK 128  // for the tasks that only count or spin
+
+static PID server_pid;
+
+/*
+ * Replies to every message with the value plus one
+ */
+void Echo_Server()
+{
+	unsigned int v;
+	PID sender;
+	for(;;) {
+		sender = Msg_Recv(ANY, &v);
+		Msg_Rply(sender, v + 1);
+	}
+}
+
+/*
+ * Send -> Recv -> Reply round trip, client and server both SYSTEM tasks.
+ * Timer ticks are not masked, so the max includes the odd tick landing
+ * inside a round trip; min and average are the numbers to compare.
+ */
+void Bench_Round_Trip()
+{
+	unsigned int i, v, t0, dt;
+	unsigned int min = 0xFFFF, max = 0;
+	unsigned long total = 0;
+
+	for(i = 0; i < ROUNDS; i++) {
+		v = i;
+		t0 = TCNT5;
+		Msg_Send(server_pid, MSG_TEST, &v);
+		dt = TCNT5 - t0;
+
+		if(v != i + 1) {
+			printf("round trip %u: bad reply %u\n", i, v);
+		}
+		if(dt < min) min = dt;
+		if(dt > max) max = dt;
+		total += dt;
+	}
+
+	printf("Send/Recv/Rply round trip, %d rounds (cycles)\n", ROUNDS);
+	printf("min: %u | avg: %lu | max: %u\n", min, total / ROUNDS, max);
+	if(PROFILE) printf("Dispatch max: %u\n", Kernel_Dispatch_Cycles_Max());
+}
+
+static volatile unsigned int cyclic_jobs;
+
+void Cyclic_Counter() PERIODIC_TASK(
+{
+	cyclic_jobs++;
+}
+)
+
+void Cyclic_Other() PERIODIC_TASK(
+{
+}
+)
+
+/*
+ * Keeps interrupts off for 9 ticks, so in TICKLESS mode the kernel next
+ * sees Elapsed jump past every table slot in between (two or three of
+ * them, back to back, with the tasks of Check_Cyclic_Rebuild()).
+ */
+void Cyclic_Hog()
+{
+	unsigned long t0 = Task_Clock();
+
+	cli();
+	while(Task_Clock() - t0 < 9UL * MSECPERTICK * 125 / 2);
+	sei();
+}
+
+/*
+ * Every job released from the table while the kernel wasn't looking must
+ * be queued, not just the last one; a lost one never runs again, and if
+ * that is the counter's it stops counting.
+ */
+void Check_Cyclic_Backlog()
+{
+	unsigned int before;
+
+	if(!TICKLESS) printf("cyclic backlog: TICKLESS is off, ticks can't pile up\n");
+	Task_Create(Cyclic_Hog, RR, 0, 0, 0, 0, OVERRUN_ABORT, 0, SMALL_STACK);
+	Task_Sleep(20);  //the hog runs and finishes meanwhile
+	before = cyclic_jobs;
+	Task_Sleep(40);
+	printf("cyclic backlog: %u jobs in 40 ticks (about 10 expected): %s\n",
+	       cyclic_jobs - before, (cyclic_jobs - before >= 8) ? "PASS" : "FAIL");
+
+	server_pid = Task_Create_System(Echo_Server, 0);
+	Task_Create_System(Bench_Round_Trip, 0);
+}
+
+/*
+ * Creating a periodic task rebuilds the cyclic table (CYCLIC_EXECUTIVE).
+ * A table task whose job is due but not yet released when that happens,
+ * as it is when this System task wakes on its release tick, must still
+ * run. One creation per tick of the counter's period hits every phase,
+ * then the counter has to keep counting.
+ */
+void Check_Cyclic_Rebuild()
+{
+	unsigned int i, offset, before;
+
+	if(!CYCLIC_EXECUTIVE) printf("cyclic rebuild: CYCLIC_EXECUTIVE is off, heap only\n");
+	cyclic_jobs = 0;
+	Task_Create(Cyclic_Counter, PERIODIC, 0, 4, 1, 0, OVERRUN_ABORT, 0, SMALL_STACK);
+	for(i = 0; i < 4; i++) {
+		Task_Sleep(1);
+		//any slot that doesn't collide with the others
+		for(offset = 0; offset < 8; offset++) {
+			if(Task_Create(Cyclic_Other, PERIODIC, 0, 8, 1, offset, OVERRUN_ABORT, 0, SMALL_STACK) != 0) break;
+		}
+	}
+	before = cyclic_jobs;
+	Task_Sleep(40);
+	printf("cyclic rebuild: %u jobs in 40 ticks (about 10 expected): %s\n",
+	       cyclic_jobs - before, (cyclic_jobs - before >= 8) ? "PASS" : "FAIL");
+
+	Task_Create_System(Check_Cyclic_Backlog, 0);
+}
+
+void user_main() {
+	TCCR5A = 0;
+	TCCR5B = (1<<CS50);
+
+	Task_Create_System(Check_Cyclic_Rebuild, 0);
+}
@@ -0,0 +1,2 @@
+call make flash
+PuTTY.exe -serial COM16
\ No newline at end of file
@@ -9,11 +9,14 @@
 
 /****TYPEDEFS*********/
 typedef void (*voidfuncptr) (void);      /* pointer to void f(void) */ 
-typedef unsigned int PID;        // always non-zero if it is valid
+typedef unsigned char PID;       // always non-zero if it is valid
 typedef unsigned int TICK;       // 1 TICK is defined by MSECPERTICK
 typedef unsigned int BOOL;       // TRUE or FALSE
 typedef unsigned char MTYPE;
 typedef unsigned char MASK; 
+typedef unsigned char MUTEX;     // always non-zero if it is valid
+typedef unsigned char SEMAPHORE; // always non-zero if it is valid
+typedef unsigned char EVENT;     // always non-zero if it is valid
 
 /*
  * This is the set of priorities that a task can be scheduled with
@@ -35,9 +38,25 @@ typedef enum process_state
     RUNNING,
 	BLOCKED_SEND,
 	BLOCKED_RECEIVE,
-	BLOCKED_REPLY
+	BLOCKED_REPLY,
+	BLOCKED_LOCK,       // waiting on a mutex or semaphore
+	BLOCKED_EVENT,      // waiting on event flags
+	BLOCKED_SLEEP,      // in Task_Sleep()
+	BLOCKED_INPUT       // in Task_Wait_Input(), e.g. for UART bytes
 } PROCESS_STATE;
 
+/*
+ * What happens when a periodic task uses up its wcet without calling
+ * Task_Next(), chosen per task at Task_Create_Period_Policy()
+ */
+typedef enum overrun_policy
+{
+    OVERRUN_ABORT = 0,  // OS_Abort(PERIODIC_OVERUSE)
+    OVERRUN_SKIP,       // stop, and carry on with this job in place of the next one
+    OVERRUN_DEFER,      // finish the job whenever no other periodic task wants the CPU, until its next release
+    OVERRUN_DEMOTE      // finish the job as an RR task
+} OVERRUN_POLICY;
+
 /*
  * Set of possible errors. These are sent to OS_Abort
  */
@@ -57,7 +76,10 @@ typedef enum error_code {
 	INVALID_MSG_SEND_REQUEST = 13,
 	INVALID_MSG_RECEIVE_REQUEST = 14,
 	INVALID_MSG_REPLY_REQUEST = 15,
-    DEBUG_IDLE_HALT = 16
+    DEBUG_IDLE_HALT = 16,
+    INVALID_LOCK_REQUEST = 17,
+    INVALID_SLEEP_REQUEST = 18,
+    STACK_OVERFLOW = 19
 } ERROR_CODE;    
 typedef enum message_type
 {
@@ -65,6 +87,26 @@ typedef enum message_type
 	MSG_SYSTEM
 } MESSAGE_TYPE;
 
+#define EXEC_BUCKETS  8    // execution time histogram buckets
+#define EXEC_BUCKET0  64   // Timer 4 counts (~1ms) below which a job is in bucket 0
+
+/*
+ * Execution time of a task's jobs, in Timer 4 counts (16us each). A job is
+ * the CPU time a task uses until it calls Task_Next(), or blocks on a
+ * message. Time the task spends preempted does not count. histogram[0]
+ * counts jobs under EXEC_BUCKET0 counts, each following bucket doubles the
+ * upper bound and the last one takes everything longer.
+ */
+typedef struct exec_stats
+{
+	unsigned long min;
+	unsigned long max;
+	unsigned long mean;
+	unsigned long total;
+	unsigned int jobs;
+	unsigned int histogram[EXEC_BUCKETS];
+} EXEC_STATS;
+
 typedef struct message
 {
 	PID pid;
@@ -86,7 +128,15 @@ typedef enum kernel_request_type
     TERMINATE,
 	SEND,
 	RECEIVE,
-	REPLY
+	REPLY,
+	MUTEX_LOCK,
+	MUTEX_UNLOCK,
+	SEM_WAIT,
+	SEM_SIGNAL,
+	EVENT_WAIT,
+	SLEEP,
+	INPUT_WAIT,
+	YIELD               // something more important became ready outside the kernel
 } KERNEL_REQUEST_TYPE;
 
 /* 
@@ -101,7 +151,14 @@ typedef struct kernel_request_param
     TICK period;
     TICK offset;
     PRIORITY priority;
+    OVERRUN_POLICY overrun;
     int arg;    
+	unsigned char object;               //mutex, semaphore or event group the request is for
+	unsigned int bits;                  //event flags waited for, and those that were set
+	unsigned char mode;                 //EVENT_ANY or EVENT_ALL, | EVENT_CLEAR
+	unsigned long wake;                 //Timer 4 count to sleep until
+	TICK quantum;                       //RR time slice on creation, 0 for RR_QUANTUM
+	unsigned int stack;                 //stack size on creation, 0 for WORKSPACE
 	MESSAGE msg_detail;
 } KERNEL_REQUEST_PARAM;
 
@@ -130,8 +187,53 @@ typedef struct kernel_request_param
 /****DEFINES***********/
 
 #define MAXTHREAD     16       
-#define WORKSPACE     256   // in bytes, per THREAD
+
+/*
+ * Elapsed wraps (every ~655s at 10ms), so TICK times are compared by their
+ * signed difference, which orders them if they are less than half the range
+ * apart. Periods and offsets are kept under MAXPERIOD, a quarter of it, so
+ * a release, a deadline and a job up to MAXPERIOD late all compare right.
+ */
+#define TICK_BEFORE(a, b) ((int)((TICK)((a) - (b))) < 0)
+#define MAXPERIOD     0x4000
+#define MAXMUTEX      8
+#define MAXSEMAPHORE  8
+#define MAXEVENT      4
+
+#define EVENT_ANY     0     // Event_Wait() until any of the bits is set
+#define EVENT_ALL     1     // ...until all of them are
+#define EVENT_CLEAR   2     // and clear them on the way out
+#define NO_REPLY      0xFFFF // what Msg_Send() gets back if the receiver terminates first
+/*
+ * Besides what the task itself uses, every stack must hold what an interrupt
+ * puts on it, about 75 bytes at worst: the return address (3) and the avr-gcc
+ * ISR prologue (r0, r1, SREG, RAMPZ, EIND and the 12 call-clobbered registers,
+ * 17), the UART RX ISR's calls through Task_Input_Ready_ISR() down to
+ * Kernel_Clock() or Kernel_Preempt() (about 20 of return addresses and saved
+ * registers), then the full context Enter_Kernel() saves (32 registers, EIND,
+ * SREG and the frame marker, 35). MINSTACK is that, the STACK_CANARY bytes, and
+ * about 16 for a task that calls nothing deeper than the kernel API.
+ * The pool is half of MAXTHREAD default stacks, so tasks that don't need
+ * WORKSPACE should ask for less (see roomba/main.c).
+ */
+#define WORKSPACE     256   // default stack in bytes, per THREAD
+#define MINSTACK      96    // smallest stack Task_Create() accepts
+#define STACKPOOL     2048  // bytes shared by all task stacks, see Task_Create()
+#define IDLESTACK     128   // the idle task's stack, kept outside the pool
+#define STACK_CHECK   1     // 1: check the calling task's canary on every kernel entry
+#define STACK_FILL    0xA5  // unused stack bytes hold this, see Task_Stack_Used()
+#define STACK_CANARY  4     // bytes at the far end of each stack that must keep STACK_FILL
 #define MSECPERTICK   10   // resolution of a system TICK in milliseconds
+#define TICKLESS      0    // 1: no periodic tick, Timer 4 only fires when the kernel has work due
+#define CYCLIC_EXECUTIVE 0 // 1: release periodic tasks from a table precomputed over their hyperperiod
+#define CYCLIC_SLOTS  64   // releases per hyperperiod the table can hold, 4 bytes each
+#define RR_QUANTUM    1    // default RR time slice in TICKs, see Task_Create_RR_Quantum()
+#define RR_FEEDBACK   0    // 1: RR tasks that use up their quantum sink to lower levels with longer ones
+#define RR_LEVELS     3    // RR feedback levels, the quantum doubles at each (at most 6)
+#define PERIODIC_FIXED 0   // periodic tasks own conflict-free slots, never preempt each other
+#define PERIODIC_EDF   1   // earliest deadline first, preemptive, wcet budget per job
+#define PERIODIC_RM    2   // rate monotonic: shorter period preempts, wcet budget per job
+#define PERIODIC_POLICY PERIODIC_FIXED // how periodic tasks share the CPU, see os.h
 #define BLINKDELAY 200
 
 //These pins are on port B
@@ -166,6 +268,8 @@ typedef struct kernel_request_param
 #define FALSE         0
 
 #define DEBUG         0
+#define PROFILE       0          // time kernel paths with Timer 5, see kernel.h
+#define EXEC_TIMING   0          // measure task execution times, see Task_Exec_Stats()
 
 #define ANY           0xFF       // a mask for ALL message type
 
@@ -73,6 +73,68 @@ EIND =  0x3C
 	push	r16
 .endm
 ;
+; Push only what a C function must preserve across a call (r2-r17, r28,
+; r29) and then the status register. This is all a voluntary entry from
+; Kernel_Request() or the kernel's own call to Exit_Kernel() needs; the
+; caller already treats r0, r18-r27, r30 and r31 as clobbered.
+;
+.macro	SAVECALLEE
+	push	r2
+	push	r3
+	push	r4
+	push	r5
+	push	r6
+	push	r7
+	push	r8
+	push	r9
+	push	r10
+	push	r11
+	push	r12
+	push	r13
+	push	r14
+	push	r15
+	push	r16
+	push	r17
+	push	r28
+	push	r29
+	in	r16, SREG
+	push	r16
+.endm
+;
+; Reverse of SAVECALLEE. r1 is the compiler's zero register and is not
+; saved, so it is cleared before SREG is restored.
+;
+.macro	RESTORECALLEE
+	clr	r1
+	pop	r16
+	out	SREG,r16
+	pop	r29
+	pop	r28
+	pop	r17
+	pop	r16
+	pop	r15
+	pop	r14
+	pop	r13
+	pop	r12
+	pop	r11
+	pop	r10
+	pop	r9
+	pop	r8
+	pop	r7
+	pop	r6
+	pop	r5
+	pop	r4
+	pop	r3
+	pop	r2
+.endm
+;
+; A task's saved context is one of the two frames above, with one more
+; byte on top telling which: FULLFRAME for SAVECTX (preempted by the
+; timer), CALLEEFRAME for SAVECALLEE (a system call).
+;
+FULLFRAME   = 1
+CALLEEFRAME = 0
+;
 ; Pop all registers and the status registers
 ;
 .macro	RESTORECTX
@@ -118,6 +180,7 @@ EIND =  0x3C
         .global CSwitch
         .global Exit_Kernel
         .global Enter_Kernel
+        .global Enter_Kernel_Voluntary
         .extern  KernelSp
         .extern  CurrentSp
 /*
@@ -140,8 +203,10 @@ Exit_Kernel:
         /* 
           * This is the "top" half of CSwitch(), generally called by the kernel.
           * Assume I = 0, i.e., all interrupts are disabled.
+          * The kernel only ever gets here by a plain C call, so only the
+          * callee-saved registers are worth keeping.
           */
-        SAVECTX
+        SAVECALLEE
         /* 
           * Now, we have saved the kernel's context.
           * Save the current H/W stack pointer into KernelSp.
@@ -161,7 +226,14 @@ Exit_Kernel:
         /*
           * We are now executing in Cp's stack.
           * Note: at the bottom of the Cp's context is its return address.
+          * The byte on top says which of the two frames is under it.
           */
+        pop  r16
+        cpi  r16, FULLFRAME
+        breq 1f
+        RESTORECALLEE
+        reti         /* re-enable all global interrupts */
+1:
         RESTORECTX
         reti         /* re-enable all global interrupts */
 /*
@@ -177,7 +249,13 @@ Exit_Kernel:
   *     we are still executing on Cp's stack. The return address of
   *     the caller of Enter_Kernel() is on the top of the stack.
   *
+  * Enter_Kernel() is for preemption, i.e., called from the TIMER4 ISR,
+  * and saves everything. Enter_Kernel_Voluntary() is for system calls
+  * made through Kernel_Request() and saves only the callee-saved
+  * registers.
+  *
   * void Enter_Kernel();
+  * void Enter_Kernel_Voluntary();
   */
 Enter_Kernel:   
         /*
@@ -185,6 +263,14 @@ Enter_Kernel:
           * Cp's context.
           */
         SAVECTX
+        ldi  r16, FULLFRAME
+        push r16
+        rjmp Enter_Kernel_Saved
+Enter_Kernel_Voluntary:
+        SAVECALLEE
+        ldi  r16, CALLEEFRAME
+        push r16
+Enter_Kernel_Saved:
         /* 
           * Now, we have saved the Cp's context.
           * Save the current H/W stack pointer into CurrentSp.
@@ -204,7 +290,7 @@ Enter_Kernel:
         /*
           * We are now executing in kernel's stack.
           */
-       RESTORECTX
+       RESTORECALLEE
         /* 
           * We are ready to return to the caller of CSwitch() (or Exit_Kernel()).
           * Note: We should NOT re-enable interrupts while kernel is running.
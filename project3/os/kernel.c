@@ -15,7 +15,7 @@
 
 /*
  * When creating a new task, it is important to initialize its stack just like
- * it has called "Enter_Kernel()"; so that when we switch to it later, we
+ * it has called "Enter_Kernel_Voluntary()"; so that when we switch to it later, we
  * can just restore its execution context on its stack.
  * (See file "cswitch.S" for details.)
  */
@@ -26,12 +26,113 @@ static void Kernel_Create_Task_At( PD *p, voidfuncptr f );
   */
 static void Kernel_Create_Task();
 
+/*
+ * Finds "size" free bytes in the stack pool, NULL if there is no room
+ */
+static unsigned char* Kernel_Stack_Alloc(unsigned int size);
+
+/*
+ * Aborts with STACK_OVERFLOW if p has written into its stack's canary
+ */
+static void Kernel_Stack_Check(PD* p);
+
+/*
+ * Admission control for periodic tasks: FALSE if the new task's wcet
+ * windows can ever overlap those of an already admitted periodic task.
+ */
+static BOOL Kernel_Admit_Periodic(TICK start, TICK period, TICK wcet);
+
+/*
+ * Where periodic tasks wait between jobs. Each one is either in the
+ * release heap, periodic_q, or (CYCLIC_EXECUTIVE only) in the precomputed
+ * cyclic table; these hide which.
+ */
+static void Kernel_Periodic_Add(PD* p);
+static void Kernel_Periodic_Requeue(PD* p);
+static PD*  Kernel_Periodic_Next();
+static BOOL Kernel_Periodic_Due();
+static BOOL Kernel_Release_Due();
+static TICK Kernel_Periodic_Key(PD* p);
+static BOOL Kernel_Periodic_Overrun();
+static void Kernel_Periodic_Overrun_Handle();
+static void Kernel_Charge_Budget();
+static BOOL Kernel_Periodic_Next_Release(TICK* next);
+static BOOL Kernel_Cyclic_Build(PD* extra);
+
+/*
+ * RR time slices: charging Cp for the ticks it ran, and starting a new
+ * slice once a task has used up its slice or given up the CPU early.
+ */
+static void Kernel_Charge_Slice();
+static void Kernel_RR_Expired(PD* p);
+static void Kernel_RR_Gave_Up(PD* p);
+
 /**
   * This internal kernel function is a part of the "scheduler". It chooses the 
   * next task to run, i.e., Cp.
   */
 static void Dispatch();
 
+/*
+ * Makes a task that was blocked on a message READY again. Blocked tasks
+ * are on no ready list, so this is the only way back in.
+ */
+static void Kernel_Unblock(PD* p);
+
+/*
+ * Picks the next task after a Send, Recv or Reply. Runs the partner the
+ * message released, or keeps Cp running, without a full Dispatch() when
+ * nothing else could be more deserving.
+ */
+static void Kernel_Msg_Switch();
+
+/*
+ * Priority inheritance: a task blocked sending to another, or waiting for
+ * its reply, lends it its SYSTEM priority. "delta" SYSTEM tasks start (+1)
+ * or stop (-1) waiting on p; the change follows p's own Send, if it is
+ * blocked in one, and so on down the chain.
+ */
+static void Kernel_Inherit(PD* p, int delta);
+
+/*
+ * A task's priority when raised by inheritance or a mutex ceiling
+ */
+static PRIORITY Kernel_Priority(PD* p);
+
+/*
+ * Settles the time Cp has run at its current priority, as entering the
+ * kernel would, before a fast path moves it to or from SYSTEM
+ */
+static void Kernel_Settle_Time();
+
+/*
+ * Mutexes and semaphores, when the fast paths in os.c can't do it alone
+ */
+static void Kernel_Request_Mutex_Lock();
+static void Kernel_Request_Mutex_Unlock();
+static void Kernel_Request_Sem_Wait();
+static void Kernel_Request_Sem_Signal();
+static void Kernel_Wake(PD* p);
+
+/*
+ * Waking a task from a fast path (outside the kernel, e.g. Event_Set() in
+ * an ISR), and then whether the caller has to enter the kernel for it.
+ * TICKLESS: Elapsed is brought up to date first, and if the caller carries
+ * on the compare match is set again for what the woken task changed.
+ */
+static void Kernel_Fast_Wake(PD* p);
+static BOOL Kernel_Fast_Preempt();
+static void Kernel_Request_Event_Wait();
+
+/*
+ * Sleeping tasks, in order of wake_at, so only the front is ever checked
+ */
+static void Kernel_Request_Sleep();
+static void Kernel_Request_Input_Wait();
+static void Kernel_Sleepers_Add(PD* p);
+static void Kernel_Wake_Sleepers();
+static BOOL Kernel_Should_Preempt();
+
 /*
  * This internal kernel function is the "main" driving loop of this full-served
  * model architecture. Basically, on Kernel_Start(), the kernel repeatedly
@@ -66,6 +167,30 @@ static void Kernel_Start();
  */
 static void Setup_System_Clock(); 
 
+/*
+ * Timer 4 counts since boot, which EXEC_TIMING also uses. Tickless mode
+ * only: Elapsed recomputed from it, and the compare match reprogrammed
+ * for the next thing that can happen.
+ */
+static unsigned long Kernel_Clock();
+static void Kernel_Update_Elapsed();
+static void Kernel_Program_Timer();
+
+/*
+ * EXEC_TIMING: adds the time since Cp was switched in to its current job,
+ * and records the job once it is over: at Task_Next(), or for a System or
+ * RR task whenever it blocks of its own accord.
+ */
+static void Kernel_Exec_Charge();
+static void Kernel_Exec_Record(PD* p);
+static void Kernel_Exec_Block();
+
+/*
+ * Decides, from inside the timer ISR, whether this tick changes anything
+ * for Cp. Only if it does is the tick turned into a kernel request.
+ */
+static BOOL Kernel_Tick_Needs_Switch();
+
 /*
  * System idle task
  */
@@ -82,10 +207,23 @@ void debug_break(int argcount, ...);
  */
 static PD Process[MAXTHREAD];
 
+/*
+ * The cold half of each of them, Process[x].info == ProcessInfo + x
+ */
+static PD_INFO ProcessInfo[MAXTHREAD];
+
 /*
  * Process descriptor for the idle task
  */
 static PD idle_process;
+static PD_INFO idle_info;
+static unsigned char idle_stack[IDLESTACK];
+
+/*
+ * Where every task's stack lives. A task owns [stack, stack + stack_size)
+ * while it is not DEAD.
+ */
+static unsigned char stack_pool[STACKPOOL];
 
 /*
  * The process descriptor of the currently RUNNING task.
@@ -94,10 +232,12 @@ volatile static PD* Cp;
 
 /*
  * The currently assigned request info, waiting to be processed
- * Requests aren't always associated with a task, so need to have this
+ * Requests aren't always associated with a task, so need to have this.
+ * It points into the caller's own stack frame (or at a static for the
+ * ISRs) and is never copied: the kernel reads the arguments and writes
+ * results, like the new pid, straight back through it.
  */
 static KERNEL_REQUEST_PARAM* current_request;
-static KERNEL_REQUEST_PARAM  current_request_copy;
 
 /* 
  * Since this is a "full-served" model, the kernel is executing using its own
@@ -129,9 +269,119 @@ volatile static unsigned int Tasks;
 /* at 10ms per tick, should take ~497 days to overflow */ 
 static TICK Elapsed;
 
-static ProcessQ periodic_q;
-static ProcessQ system_q;
-static ProcessQ rr_q;
+/* Timer 4 counts (62500 per second) in one TICK */
+#define CLOCKSPERTICK (62500UL * ((MSECPERTICK>1000)? 1000 : MSECPERTICK) / 1000)
+
+/*
+ * Tickless bookkeeping. Elapsed does not advance while a SYSTEM task runs,
+ * so the counts spent in SYSTEM tasks are kept in "frozen" and left out.
+ */
+static volatile unsigned int clock_overflows;
+static volatile unsigned long clock_ticks;  // ticks since boot, if not TICKLESS
+static unsigned long frozen;
+static unsigned long last_switch;
+static unsigned long timer_target;
+
+/*
+ * Periodic tasks, released when Elapsed passes their next_start
+ */
+static ReleaseQ periodic_q;
+
+/*
+ * Released jobs that have not finished, by deadline (PERIODIC_EDF) or by
+ * period (PERIODIC_RM), and after them OVERRUN_DEFER jobs that overran.
+ * Under PERIODIC_FIXED a released job is run at once, so only the latter
+ * are ever in here.
+ */
+static ReleaseQ periodic_ready;
+
+/* Elapsed when Cp was last switched in, to charge a job's budget */
+static TICK switched_in;
+
+/* preemptive policies enforce wcet as a budget per job, in "remaining" */
+#define BUDGETED (PERIODIC_POLICY != PERIODIC_FIXED)
+
+/* a periodic task, including one demoted to RR for the rest of its job */
+#define IS_PERIODIC(p) ((p)->base_priority == PERIODIC || (p)->overran)
+
+/*
+ * Mutexes and counting semaphores. Waiting tasks are linked through their
+ * "next" field, like senders, so blocking and waking are O(1).
+ */
+typedef struct mutex_cb {
+    BOOL used;
+    unsigned char ceiling;  // PRIORITY
+    BOOL raised;    // the owner runs as SYSTEM, see Kernel_Mutex_Raises()
+    PD* owner;
+    ProcessQ waiters;
+} MUTEX_CB;
+
+typedef struct semaphore_cb {
+    BOOL used;
+    unsigned int count;
+    ProcessQ waiters;
+} SEMAPHORE_CB;
+
+/*
+ * Event flag groups. Waiters are linked like the above, but setting flags
+ * may wake any of them, so the whole list is walked.
+ */
+typedef struct event_cb {
+    BOOL used;
+    unsigned int flags;
+    ProcessQ waiters;
+} EVENT_CB;
+
+static MUTEX_CB mutexes[MAXMUTEX];
+static SEMAPHORE_CB semaphores[MAXSEMAPHORE];
+static EVENT_CB events[MAXEVENT];
+
+#define MUTEX_OF(m)     (((m) == 0 || (m) > MAXMUTEX || !mutexes[(m) - 1].used) ? NULL : mutexes + ((m) - 1))
+#define SEMAPHORE_OF(s) (((s) == 0 || (s) > MAXSEMAPHORE || !semaphores[(s) - 1].used) ? NULL : semaphores + ((s) - 1))
+#define EVENT_OF(e)     (((e) == 0 || (e) > MAXEVENT || !events[(e) - 1].used) ? NULL : events + ((e) - 1))
+
+/* the flags of "bits" that are set, if that satisfies "mode", else 0 */
+#define EVENT_MATCH(flags, bits, mode) \
+    ((((mode) & EVENT_ALL) ? (((flags) & (bits)) == (bits)) : 1) ? ((flags) & (bits)) : 0)
+
+/*
+ * Cyclic executive (CYCLIC_EXECUTIVE): every release of the table's tasks
+ * over one hyperperiod, sorted by tick. "cyclic_next" walks the table as
+ * time passes, so finding the due task is a single compare.
+ */
+typedef struct cyclic_slot {
+    TICK tick;      // from cyclic_base
+    PD* task;
+} CYCLIC_SLOT;
+
+static CYCLIC_SLOT cyclic_table[CYCLIC_SLOTS];
+static unsigned int cyclic_length;
+static unsigned int cyclic_next;
+static TICK cyclic_hyperperiod;
+static TICK cyclic_base;
+static ProcessQ cyclic_ready; // released from the table, in release order, not run yet
+
+/*
+ * READY system and RR tasks. Blocked tasks are never linked in here; they
+ * are pushed back by Kernel_Unblock() when their partner releases them.
+ */
+static ReadyQ ready_q;
+
+/*
+ * BLOCKED_SLEEP tasks, and BLOCKED_INPUT ones by their timeout, soonest
+ * to wake first
+ */
+static ProcessQ sleepers;
+
+/*
+ * Task released by the current Send or Reply, for Kernel_Msg_Switch().
+ * It is READY but on no ready list yet.
+ */
+static PD* handoff;
+
+/* cycle counts of the last and the slowest Dispatch(), only kept if PROFILE */
+static unsigned int dispatch_cycles;
+static unsigned int dispatch_cycles_max;
 
 BOOL idling;
 
@@ -143,6 +393,10 @@ char* Get_State(short s) {
 		case BLOCKED_SEND:		return "BLOCKED_SEND";
 		case BLOCKED_RECEIVE:	return "BLOCKED_RECEIVE";
 		case BLOCKED_REPLY:		return "BLOCKED_REPLY";
+		case BLOCKED_LOCK:		return "BLOCKED_LOCK";
+		case BLOCKED_EVENT:		return "BLOCKED_EVENT";
+		case BLOCKED_SLEEP:		return "BLOCKED_SLEEP";
+		case BLOCKED_INPUT:		return "BLOCKED_INPUT";
 		default:				return "NOT FOUND";
 	}
 }
@@ -157,6 +411,14 @@ char* Get_Request_Type(short s) {
 		case SEND:		return "SEND";
 		case RECEIVE:	return "RECEIVE";
 		case REPLY:		return "REPLY";
+		case MUTEX_LOCK:	return "MUTEX_LOCK";
+		case MUTEX_UNLOCK:	return "MUTEX_UNLOCK";
+		case SEM_WAIT:	return "SEM_WAIT";
+		case SEM_SIGNAL:	return "SEM_SIGNAL";
+		case EVENT_WAIT:	return "EVENT_WAIT";
+		case SLEEP:		return "SLEEP";
+		case INPUT_WAIT:	return "INPUT_WAIT";
+		case YIELD:		return "YIELD";
 		default:		return "NOT FOUND";
 	}
 }
@@ -170,10 +432,10 @@ static void Kernel_Create_Task_At( PD *p, voidfuncptr f )
 {   
    unsigned char *sp;
 
-   sp = (unsigned char *) &(p->workSpace[WORKSPACE-1]);
+   sp = p->info->stack + p->info->stack_size - 1;
 
-   //Clear the contents of the workspace
-   memset(&(p->workSpace),0,WORKSPACE);
+   //Fill the workspace with the pattern Kernel_Stack_Used() looks for
+   memset(p->info->stack,STACK_FILL,p->info->stack_size);
 
    //Notice that we are placing the address (16-bit) of the functions
    //onto the stack in reverse byte order (least significant first, followed
@@ -191,12 +453,14 @@ static void Kernel_Create_Task_At( PD *p, voidfuncptr f )
    *(unsigned char *)sp-- = HIGH_BYTE(f);
    *(unsigned char *)sp-- = LOW_BYTE(0);
 
-   //Place stack pointer at top of stack
-   sp = sp - 34;
+   //Place stack pointer at top of stack. The task starts from a callee-saved
+   //frame (r2-r17, r28, r29, SREG and the frame type byte, 20 bytes), all
+   //zero, so the frame type is CALLEEFRAME.
+   sp = sp - 20;
+   memset(sp + 1, 0, 20);
      
-   p->sp = sp;		/* stack pointer into the "workSpace" */
-   p->code = f;		/* function to be executed as a task */
-   p->request_param.request_type = NONE;
+   p->sp = sp;		/* stack pointer into "stack" */
+   p->info->code = f;		/* function to be executed as a task */
 
    p->state = READY;
    Tasks++;
@@ -209,36 +473,66 @@ static void Kernel_Create_Task_At( PD *p, voidfuncptr f )
 static void Kernel_Create_Task() 
 {
     int x;
+    unsigned int size;
+    unsigned char* stack;
+    current_request->pid = 0;   /* not created, unless we get to the end */
     if (Tasks == MAXTHREAD) return;  /* Too many task! */
 
+    size = (current_request->stack == 0) ? WORKSPACE : current_request->stack;
+    if (size < MINSTACK) return;  /* no room for a preempted context */
+    stack = Kernel_Stack_Alloc(size);
+    if (stack == NULL) return;  /* no room in the pool */
+
+    if (current_request->priority == PERIODIC &&
+            (current_request->offset >= MAXPERIOD ||
+             !Kernel_Admit_Periodic(Elapsed + current_request->offset,
+                                    current_request->period, current_request->wcet))) {
+        return;
+    }
+
     /* find a DEAD PD that we can use  */
     for (x = 0; x < MAXTHREAD; x++) {
         if (Process[x].state == DEAD) break;
     }
     if(x < MAXTHREAD) {
+        Process[x].info->stack = stack;
+        Process[x].info->stack_size = size;
         Kernel_Create_Task_At(Process + x, current_request->code);
         
-        Process[x].arg = current_request->arg;
+        Process[x].info->arg = current_request->arg;
         Process[x].priority = current_request->priority;
-        Process[x].pid = x;
+        Process[x].base_priority = current_request->priority;
+        Process[x].boosters = 0;
+        Process[x].ceilings = 0;
+        Process[x].locks = 0;
+        Process[x].pid = x + 1;   /* PID 0 means no task */
+        Process[x].cyclic = FALSE;
+        Process[x].info->overrun_policy = current_request->overrun;
+        Process[x].overran = FALSE;
+        Process[x].info->misses = 0;
+        Process[x].info->quantum = (current_request->quantum > 0) ? current_request->quantum : RR_QUANTUM;
+        Process[x].rr_level = 0;
+        Process[x].slice = Process[x].info->quantum;
+        Q_Init(&Process[x].senders, Process[x].priority);
         
         //need to pass back pid. PD holds copy of param struct for safety reasons
         //so current_request pointer needs to be assigned to
-        current_request->pid = x;
+        current_request->pid = Process[x].pid;
         
         switch (Process[x].priority){
             case SYSTEM:
-                Q_Push(&system_q, Process + x);
+                RQ_Push(&ready_q, Process + x);
                 break;
             case PERIODIC:
 				Process[x].wcet = current_request->wcet;
 				Process[x].period = current_request->period;
 				Process[x].next_start = Elapsed + current_request->offset;
+				Process[x].remaining = 0;
 				Process[x].state = READY;
-                Q_Insert(&periodic_q, Process + x);
+                Kernel_Periodic_Add(Process + x);
                 break;
             case RR:
-                Q_Push(&rr_q, Process + x);
+                RQ_Push(&ready_q, Process + x);
                 break;
             default:
                 OS_Abort(INVALID_PRIORITY_CREATE);
@@ -249,248 +543,1557 @@ static void Kernel_Create_Task()
     }
 }
 
-
 /*
- * This internal kernel function is a part of the "scheduler". It chooses the 
- * next task to run, i.e., Cp.
+ * First fit: the lowest of the pool start and the ends of live stacks
+ * where "size" bytes overlap no live stack. A DEAD task's stack is free
+ * again without any bookkeeping. Only runs at task creation, so going
+ * over every pair of tasks is fine.
  */
-static void Dispatch()
+static unsigned char* Kernel_Stack_Alloc(unsigned int size)
 {
-    if(DEBUG) puts("dispatch\n");
+    unsigned char* c;
+    int i, j;
 
-    if(Cp != NULL){
-		//put current process back in queue, if relevant
-		//if the request was terminate, Cp should already be dead    
-        switch(Cp->priority) {
-            case SYSTEM:
-				if(Cp->state == RUNNING) {
-					Cp->state = READY;
-				}
-                //only push system task if it isn't dead
-                if(Cp->state != DEAD) {
-                    Q_Push(&system_q, (PD*)Cp);
-                }
-                /*else if (Cp->state == DEAD){
-                    break;
-                }
-                else{
-                    OS_Abort(INVALID_STATE_DISPATCH);
-                }*/
-                break;
-            case PERIODIC:
-                Q_Insert(&periodic_q, (PD*)Cp);
-                break;
-            case RR:
-            // RR Task needs to be at beginning of queue if preempted
-				if(Cp->state == RUNNING) {
-                    Cp->state = READY;
-				}
-                if(Cp->state != DEAD){
-                    Q_Push(&rr_q, (PD*)Cp);
-                }
-                break;
-            case IDLE:
-                break;
-            default:
-                OS_Abort(INVALID_PRIORITY_DISPATCH);
-                break;
+    for(i = -1; i < MAXTHREAD; i++) {
+        if(i < 0) {
+            c = stack_pool;
         }
-    }
-    idling = FALSE;
-    Cp = NULL;
-    //find new process 
-    if (system_q.length > 0) {
-        Cp = Q_Pop_Ready(&system_q);
-       /* if(Cp == NULL) {
-            // This shouldnt be queue error now
-            OS_Abort(QUEUE_ERROR);
-        }*/
-    }
-    if(Cp == NULL && periodic_q.length > 0) {
-        int r_count = Q_CountScheduledTasks(&periodic_q, Elapsed);
-	
-        if(r_count > 1){
-            OS_Abort(TIMING_VIOLATION);
+        else if(Process[i].state == DEAD) {
+            continue;
         }
-        else if(r_count == 1){
-            Cp = Q_Pop(&periodic_q);
+        else {
+            c = Process[i].info->stack + Process[i].info->stack_size;
+        }
+        if(size > (unsigned int)(stack_pool + STACKPOOL - c)) {
+            continue;
+        }
+        for(j = 0; j < MAXTHREAD; j++) {
+            if(Process[j].state != DEAD && c < Process[j].info->stack + Process[j].info->stack_size &&
+                    Process[j].info->stack < c + size) {
+                break;
+            }
+        }
+        if(j == MAXTHREAD) {
+            return c;
         }
     }
-    if(Cp == NULL && rr_q.length > 0) {
-        Cp = Q_Pop_Ready(&rr_q);
-    }
-    
-    if(Cp == NULL) {
-        idling = TRUE;
-        Cp = &idle_process;
-    } else {
-        Cp->state = RUNNING;
-	}
-    if(!idling) {
-        BIT_RESET(OUTPUT_PORT, IDLE_PIN);
+    return NULL;
+}
+
+static TICK gcd(TICK a, TICK b)
+{
+    TICK t;
+    while(b != 0) {
+        t = a % b;
+        a = b;
+        b = t;
     }
+    return a;
 }
 
 /*
- * This is the main loop of our kernel, called by Kernel_Start().
+ * Under EDF with deadline = period, a task set is schedulable exactly when
+ * its total utilization is at most 1. Each wcet/period is taken in 1/65536
+ * units, rounded up, so rounding can only refuse a task, never let one in.
  */
- int num_next = 0;
-static void Kernel_Next_Request() 
+static unsigned long Kernel_Utilization(TICK period, TICK wcet)
 {
-    Dispatch();  /* select a new task to run */
-
-    while(1) {
-        Cp->request_param.request_type = NONE; /* clear its request */
+    return (((unsigned long)wcet << 16) + period - 1) / period;
+}
 
-        /* activate this newly selected task */
-        CurrentSp = Cp->sp;
-        Exit_Kernel();    /* The task will be running after this */
+static BOOL Kernel_Admit_EDF(TICK period, TICK wcet)
+{
+    int x;
+    unsigned long u = Kernel_Utilization(period, wcet);
 
-        /* if this task makes a system call, it will return to here! */
+    for(x = 0; x < MAXTHREAD; x++) {
+        if(Process[x].state != DEAD && IS_PERIODIC(Process + x)) {
+            u += Kernel_Utilization(Process[x].period, Process[x].wcet);
+        }
+    }
+    return u <= 0x10000UL;
+}
 
-        /* save the Cp's stack pointer */
-        if(DEBUG) printf("Kernel_Next_Request Info:\nType: %d | Priority: %d\n", 
-                                        current_request->request_type, current_request->priority);
-        Cp->sp = CurrentSp;
-        if(current_request == NULL) {
-            OS_Abort(NULL_REQUEST);
+/*
+ * Under rate monotonic every task must finish within its period even when
+ * released together with all tasks of shorter or equal period (offsets are
+ * ignored, which can only make this stricter). Its worst-case response
+ * time is the fixed point of
+ *     R = C_i + sum over those j of ceil(R / T_j) * C_j
+ * which only grows, so the iteration stops once it settles or passes T_i.
+ */
+static BOOL Kernel_Admit_RM(TICK period, TICK wcet)
+{
+    TICK T[MAXTHREAD + 1];
+    TICK C[MAXTHREAD + 1];
+    unsigned int n = 0;
+    unsigned int i, j;
+    unsigned long r, next;
+
+    for(i = 0; i < MAXTHREAD; i++) {
+        if(Process[i].state != DEAD && IS_PERIODIC(Process + i)) {
+            T[n] = Process[i].period;
+            C[n] = Process[i].wcet;
+            n++;
         }
-		
-        switch(current_request_copy.request_type){
-            case CREATE:
-                Kernel_Create_Task();
-                break;
-            case NEXT:
-                if(Cp->priority == PERIODIC) {
-                    Cp->next_start = Cp->next_start + Cp->period;
-                }
-                num_next++;
-                Cp->state = READY;
-                Dispatch();
-                break;
-            case TERMINATE:
-                /* deallocate all resources used by this task */
-                Kernel_Request_Terminate();
-                Dispatch();
-                break;
-            case TIMER_TICK:
-                //SYSTEM should never need an interrupt to switch (some timeout is a good idea?)
-                //PERIODIC should update here, and dispatch if past wcet
-                //RR is lowest priority, so dispatch immediately here
-                if(idling || Cp->priority == RR) { 
-                    Dispatch();
-                }
-                else if(Cp->priority == PERIODIC){
-                    if(Cp->next_start + Cp->wcet <= Elapsed){
-                        OS_Abort(PERIODIC_OVERUSE);
-                    }
-                }
-                else {
-                    if(DEBUG) printf("system_q: %d\nperiodic_q: %d\nrr_q: %d\n\nCp priority: %d\nCp PID: %d\n", 
-                                system_q.length, periodic_q.length, rr_q.length,
-                                Cp->priority, Cp->pid);
+    }
+    T[n] = period;
+    C[n] = wcet;
+    n++;
+
+    for(i = 0; i < n; i++) {
+        next = C[i];
+        do {
+            r = next;
+            next = C[i];
+            for(j = 0; j < n; j++) {
+                if(j != i && T[j] <= T[i]) {
+                    next += (r + T[j] - 1) / T[j] * C[j];
                 }
-                break;
-            case SEND:
-				if(DEBUG) printf("SEND\n");
-				if(Cp->priority == PERIODIC) {
-					OS_Abort(INVALID_MSG_SEND_REQUEST);
-				}
-				Kernel_Request_Msg_Send();
-				Dispatch();
-				break;
-			case RECEIVE:
-				if(DEBUG) printf("Receive Mask: %d\n", current_request->msg_detail.mask);
-				if(Cp->priority == PERIODIC) {
-					OS_Abort(INVALID_MSG_RECEIVE_REQUEST);
-				}
-				Kernel_Request_Msg_Recv();
-				Dispatch();
-				break;
-			case REPLY:
-				if(DEBUG) printf("Reply\n");
-				if(Cp->priority == PERIODIC) {
-					OS_Abort(INVALID_MSG_REPLY_REQUEST);
-				}
-				Kernel_Request_Msg_Reply();
-				Dispatch();
-				break;
-            default:
-                /* Houston! we have a problem here! */
-                if(DEBUG) printf("request type: %d\n", current_request_copy.request_type);
-                OS_Abort(INVALID_REQUEST);
-                break;
-        }
-        current_request = NULL;
-
-        if(DEBUG) printf("exiting kernel\n");
-    } 
+            }
+            if(next > T[i]) {
+                return FALSE;
+            }
+        } while(next != r);
+    }
+    return TRUE;
 }
 
-int Kernel_GetArg() {
-    return Cp->arg;
-}
-PID Kernel_GetPid() {
-    return Cp->pid;
-}
+/*
+ * Job k of task i occupies [start_i + k*period_i, start_i + k*period_i + wcet_i).
+ * The distances between the starts of two tasks are exactly the numbers
+ * congruent to (start_j - start_i) mod gcd(period_i, period_j), so checking
+ * the two closest ones is the same as walking their whole hyperperiod.
+ * No two admitted tasks collide pairwise, so no two can ever be ready at once.
+ */
+static BOOL Kernel_Admit_Periodic(TICK start, TICK period, TICK wcet)
+{
+    int x;
+    TICK g, r;
+    PD* p;
 
-TICK Kernel_GetElapsed() {
-	return Elapsed;
+    if(period == 0 || period >= MAXPERIOD || wcet >= period) {
+        return FALSE;
+    }
+    if(PERIODIC_POLICY == PERIODIC_EDF) {
+        return Kernel_Admit_EDF(period, wcet);
+    }
+    if(PERIODIC_POLICY == PERIODIC_RM) {
+        return Kernel_Admit_RM(period, wcet);
+    }
+    for(x = 0; x < MAXTHREAD; x++) {
+        p = Process + x;
+        if(p->state == DEAD || !IS_PERIODIC(p)) {
+            continue;
+        }
+        g = gcd(period, p->period);
+        //the new task starts r ticks after some job of p
+        if(!TICK_BEFORE(start, p->next_start)) {
+            r = (start - p->next_start) % g;
+        }
+        else {
+            r = (g - (p->next_start - start) % g) % g;
+        }
+        if(r < p->wcet || g - r < wcet) {
+            return FALSE;
+        }
+    }
+    return TRUE;
 }
 
-static void Kernel_Request_Msg_Send(){
-        if(current_request->msg_detail.pid < MAXTHREAD && Process[current_request->msg_detail.pid].state != DEAD) {
-					Cp->msg_detail.pid = current_request->msg_detail.pid;
-					Cp->msg_detail.msg = current_request->msg_detail.msg;
-					Cp->msg_detail.type = current_request->msg_detail.type;
-					Cp->state = BLOCKED_SEND;
-					int x;
-					for(x = 0; x < MAXTHREAD; x++) { // Check to see if any messages are blocked by receive
-					
-						if(Process[x].state == BLOCKED_RECEIVE) {
-							if(DEBUG) printf("Found: %d\n", Process[x].pid);
-							if(DEBUG) printf("Message: %d\n", Cp->msg_detail.pid);
-							if(DEBUG) printf("Mask: %d\n", (Process[x].msg_detail.mask));
-							if(DEBUG) printf("Type: %d\n",  Cp->msg_detail.type);
-							
-							if(Process[x].pid == Cp->msg_detail.pid && (Process[x].msg_detail.mask & Cp->msg_detail.type))
-							{
-								current_request->msg_detail.pid = Process[x].msg_detail.pid = Cp->pid;
-								*(Cp->msg_detail.msg) = *(Process[x].msg_detail.msg);
-								Cp->state = BLOCKED_REPLY;
-								Process[x].state = READY;
-								break;
-							}
-						}
-					}
-				} else {
-					// NO MATCHING PID OR OUT OF RANGE
-				}
+/*
+ * A new periodic task goes into the cyclic table if the table can take it,
+ * otherwise into the release heap. The table only fits fixed slots.
+ */
+static void Kernel_Periodic_Add(PD* p)
+{
+    if(CYCLIC_EXECUTIVE && PERIODIC_POLICY == PERIODIC_FIXED && Kernel_Cyclic_Build(p)) {
+        p->cyclic = TRUE;
+    }
+    else {
+        H_Insert(&periodic_q, p, p->next_start);
+    }
 }
-static void Kernel_Request_Msg_Recv(){
-current_request->msg_detail.pid = 0;
-				Cp->state = BLOCKED_RECEIVE;
-				
-				Cp->msg_detail.mask = current_request->msg_detail.mask;
-				int x;
-				for(x = 0; x < MAXTHREAD; x++) { // Check to see if any messages are blocked by send for the current process
-					if(Process[x].state == BLOCKED_SEND && Process[x].msg_detail.pid == Cp->pid && (Process[x].msg_detail.type & Cp->msg_detail.mask)) {
-				BIT_SET(SYSTEM_PORT, 1);
-						current_request->msg_detail.pid = Cp->msg_detail.pid = Process[x].pid;
-						
-						*(Cp->msg_detail.msg) = *(Process[x].msg_detail.msg);
-						Process[x].state = BLOCKED_REPLY;
-						Cp->state = READY;
-						break;
-					}
+
+/*
+ * Cp is a periodic task giving up the CPU. It is either done with its job
+ * (Task_Next() moved next_start on) or was preempted in the middle of it.
+ */
+static void Kernel_Periodic_Requeue(PD* p)
+{
+    if(p->overran || (BUDGETED && p->remaining > 0)) {
+        //preempted, its job is still released
+        H_Insert(&periodic_ready, p, Kernel_Periodic_Key(p));
+    }
+    else if(p->cyclic) {
+        //the table releases it again at next_start; until then it sits nowhere
+        if(TICK_BEFORE(p->next_start, Elapsed)) {
+            Q_Push(&cyclic_ready, p);
+        }
+    }
+    else {
+        H_Insert(&periodic_q, p, p->next_start);
+    }
+}
+
+/*
+ * Moves the table cursor past every slot that has come up, queueing the
+ * jobs of those that are the task's actual next release (slots of a task
+ * whose first release is more than one hyperperiod away don't count).
+ * Several can come up at once, e.g. while a System task ran.
+ */
+static void Kernel_Cyclic_Release()
+{
+    CYCLIC_SLOT* s;
+    while(cyclic_length > 0) {
+        s = cyclic_table + cyclic_next;
+        if(!TICK_BEFORE(cyclic_base + s->tick, Elapsed)) {
+            break;
+        }
+        if(s->task->next_start == cyclic_base + s->tick) {
+            Q_Push(&cyclic_ready, s->task);
+        }
+        if(++cyclic_next == cyclic_length) {
+            cyclic_next = 0;
+            cyclic_base += cyclic_hyperperiod;
+        }
+    }
+}
+
+/*
+ * The periodic task to run now, if any, taken off whatever it waited in
+ */
+static PD* Kernel_Periodic_Next()
+{
+    PD* p;
+    if(CYCLIC_EXECUTIVE) {
+        Kernel_Cyclic_Release();
+        if(cyclic_ready.length > 0) {
+            return Q_Pop(&cyclic_ready);
+        }
+    }
+    if(BUDGETED) {
+        //release everything that is due, then run the most urgent
+        while(Kernel_Release_Due()) {
+            p = H_Pop(&periodic_q);
+            p->remaining = p->wcet;
+            H_Insert(&periodic_ready, p, Kernel_Periodic_Key(p));
+        }
+        return H_Pop(&periodic_ready);
+    }
+    if(Kernel_Release_Due()) {
+        return H_Pop(&periodic_q);
+    }
+    return H_Pop(&periodic_ready);
+}
+
+/*
+ * TRUE if Kernel_Periodic_Next() would have something (or a stale table
+ * slot to skip, which costs one extra Dispatch() at most)
+ */
+static BOOL Kernel_Periodic_Due()
+{
+    if(CYCLIC_EXECUTIVE && (cyclic_ready.length > 0 ||
+            (cyclic_length > 0 && TICK_BEFORE(cyclic_base + cyclic_table[cyclic_next].tick, Elapsed)))) {
+        return TRUE;
+    }
+    return periodic_ready.length > 0 || Kernel_Release_Due();
+}
+
+/*
+ * Order of released jobs: the deadline under EDF, the period under RM.
+ * Deferred overruns go last, after any deadline up to MAXPERIOD late and
+ * any period, which are under MAXPERIOD.
+ */
+static TICK Kernel_Periodic_Key(PD* p)
+{
+    if(p->overran) {
+        return (PERIODIC_POLICY == PERIODIC_RM) ? MAXPERIOD : Elapsed + MAXPERIOD;
+    }
+    if(PERIODIC_POLICY == PERIODIC_RM) {
+        return p->period;
+    }
+    return p->next_start + p->period;
+}
+
+/*
+ * TRUE if a periodic task in the release heap has come up
+ */
+static BOOL Kernel_Release_Due()
+{
+    return periodic_q.length > 0 && TICK_BEFORE(H_Peek_Key(&periodic_q), Elapsed);
+}
+
+/*
+ * TRUE if Cp, a periodic task, has used up its wcet on the current job.
+ * With fixed slots the job is measured from its release; with a budget,
+ * only the ticks it actually ran count. A deferred overrun is up once its
+ * own next release comes, so it can't hold off RR tasks for longer.
+ */
+static BOOL Kernel_Periodic_Overrun()
+{
+    if(Cp->overran) {
+        return !TICK_BEFORE(Elapsed, Cp->next_start + Cp->period);
+    }
+    if(BUDGETED) {
+        return Cp->remaining == 0;
+    }
+    return !TICK_BEFORE(Elapsed, Cp->next_start + Cp->wcet);
+}
+
+static void Kernel_Charge_Slice()
+{
+    TICK used = Elapsed - switched_in;
+
+    Cp->slice = (used < Cp->slice) ? Cp->slice - used : 0;
+    switched_in = Elapsed;
+}
+
+/*
+ * With RR_FEEDBACK, a task that keeps using up its slice is CPU bound and
+ * sinks a level, where it waits behind the others but gets twice as long
+ */
+static void Kernel_RR_Expired(PD* p)
+{
+    if(RR_FEEDBACK && p->rr_level < RR_SUBLEVELS - 1) {
+        p->rr_level++;
+    }
+    p->slice = p->info->quantum << p->rr_level;
+}
+
+/*
+ * ...and one that yields or blocks before its slice is up rises a level
+ */
+static void Kernel_RR_Gave_Up(PD* p)
+{
+    if(RR_FEEDBACK && p->rr_level > 0) {
+        p->rr_level--;
+    }
+    p->slice = p->info->quantum << p->rr_level;
+}
+
+/*
+ * Cp used up its wcet; apply its overrun policy
+ */
+static void Kernel_Periodic_Overrun_Handle()
+{
+    if(Cp->overran) {
+        //a deferred job that ran into its next release finishes at RR
+        Cp->priority = Cp->base_priority = RR;
+        Dispatch();
+        return;
+    }
+    if(Cp->info->misses < 0xFFFF) {
+        Cp->info->misses++;
+    }
+    switch(Cp->info->overrun_policy) {
+        case OVERRUN_SKIP:
+            //the rest of this job takes the place of the next one
+            Cp->next_start += Cp->period;
+            Cp->remaining = 0;
+            Dispatch();
+            break;
+        case OVERRUN_DEFER:
+            Cp->overran = TRUE;
+            Dispatch();
+            break;
+        case OVERRUN_DEMOTE:
+            Cp->overran = TRUE;
+            Cp->priority = Cp->base_priority = RR;
+            Dispatch();
+            break;
+        default:
+            OS_Abort(PERIODIC_OVERUSE);
+            break;
+    }
+}
+
+/*
+ * Takes the ticks Cp has run since it was switched in off its job's budget
+ */
+static void Kernel_Charge_Budget()
+{
+    TICK used = Elapsed - switched_in;
+
+    Cp->remaining = (used < Cp->remaining) ? Cp->remaining - used : 0;
+    switched_in = Elapsed;
+}
+
+/*
+ * The next tick at which a periodic task is released, FALSE if none is waiting
+ */
+static BOOL Kernel_Periodic_Next_Release(TICK* next)
+{
+    BOOL found = FALSE;
+    TICK t;
+
+    if(CYCLIC_EXECUTIVE && cyclic_length > 0) {
+        *next = cyclic_base + cyclic_table[cyclic_next].tick;
+        found = TRUE;
+    }
+    if(periodic_q.length > 0) {
+        t = H_Peek_Key(&periodic_q);
+        if(!found || (int)(t - *next) < 0) {
+            *next = t;
+        }
+        found = TRUE;
+    }
+    return found;
+}
+
+/*
+ * Recomputes the cyclic table for the tasks already in it plus "extra",
+ * counting from now. Fails, leaving the table as it was, if the
+ * hyperperiod doesn't fit a TICK or it has more than CYCLIC_SLOTS releases.
+ * The new table only holds releases from now on, so a task whose job is
+ * already due (next_start < Elapsed, e.g. a System task was picked on its
+ * tick) is queued on cyclic_ready rather than lost with the old table.
+ */
+static BOOL Kernel_Cyclic_Build(PD* extra)
+{
+    unsigned long hyper = 1;
+    unsigned int jobs = 0;
+    unsigned int n = 0;
+    unsigned int i, j;
+    unsigned long t;
+    TICK phase;
+    PD* p;
+    PD* q;
+
+    #define IN_TABLE(p) ((p)->state != DEAD && ((p)->cyclic || (p) == extra))
+
+    for(i = 0; i < MAXTHREAD; i++) {
+        p = Process + i;
+        if(IN_TABLE(p)) {
+            hyper = hyper / gcd(hyper, p->period) * p->period;
+            if(hyper > 0xFFFF) {
+                return FALSE;
+            }
+        }
+    }
+    for(i = 0; i < MAXTHREAD; i++) {
+        p = Process + i;
+        if(IN_TABLE(p)) {
+            jobs += hyper / p->period;
+        }
+    }
+    if(jobs > CYCLIC_SLOTS) {
+        return FALSE;
+    }
+
+    for(i = 0; i < MAXTHREAD; i++) {
+        p = Process + i;
+        if(!IN_TABLE(p)) {
+            continue;
+        }
+        //Cp goes back through Kernel_Periodic_Requeue(), a blocked one
+        //through Kernel_Wake(), and one already queued stays where it is
+        if(TICK_BEFORE(p->next_start, Elapsed) && p != Cp && p->state != BLOCKED_INPUT) {
+            for(q = cyclic_ready.front; q != NULL && q != p; q = q->next);
+            if(q == NULL) {
+                Q_Push(&cyclic_ready, p);
+            }
+        }
+        //first release at or after now
+        if(!TICK_BEFORE(p->next_start, Elapsed)) {
+            phase = (p->next_start - Elapsed) % p->period;
+        }
+        else {
+            phase = (p->period - (Elapsed - p->next_start) % p->period) % p->period;
+        }
+        for(t = phase; t < hyper; t += p->period) {
+            //insertion sort, this only runs at task creation
+            for(j = n; j > 0 && cyclic_table[j - 1].tick > t; j--) {
+                cyclic_table[j] = cyclic_table[j - 1];
+            }
+            cyclic_table[j].tick = t;
+            cyclic_table[j].task = p;
+            n++;
+        }
+    }
+    #undef IN_TABLE
+
+    cyclic_length = n;
+    cyclic_hyperperiod = hyper;
+    cyclic_base = Elapsed;
+    cyclic_next = 0;
+    return TRUE;
+}
+
+/*
+ * This internal kernel function is a part of the "scheduler". It chooses the 
+ * next task to run, i.e., Cp.
+ */
+static void Dispatch()
+{
+    unsigned int t0 = 0;
+    unsigned char level;
+
+    if(DEBUG) puts("dispatch\n");
+    if(PROFILE) t0 = TCNT5;
+
+    if(Cp != NULL){
+		//put current process back in queue, if relevant
+		//if the request was terminate, Cp should already be dead    
+        switch(Cp->priority) {
+            case SYSTEM:
+				if(Cp->state == RUNNING) {
+					Cp->state = READY;
 				}
+                //only ready tasks go back in; blocked ones wait for Kernel_Unblock()
+                if(Cp->state == READY) {
+                    RQ_Push(&ready_q, (PD*)Cp);
+                }
+                break;
+            case RR:
+				if(Cp->state == RUNNING) {
+					Cp->state = READY;
+				}
+                //preempted ones go back to the front with what is left of their slice
+                if(Cp->state == READY && Cp->slice > 0) {
+                    RQ_Push_Front(&ready_q, (PD*)Cp);
+                }
+                else if(Cp->state == READY) {
+                    Kernel_RR_Expired((PD*)Cp);
+                    RQ_Push(&ready_q, (PD*)Cp);
+                }
+                break;
+            case PERIODIC:
+                //a blocked one is requeued by Kernel_Wake()
+                if(Cp->state != BLOCKED_INPUT) {
+                    Kernel_Periodic_Requeue((PD*)Cp);
+                }
+                break;
+            case IDLE:
+                break;
+            default:
+                OS_Abort(INVALID_PRIORITY_DISPATCH);
+                break;
+        }
+    }
+    idling = FALSE;
+    Cp = NULL;
+    //find new process 
+    level = RQ_Highest(&ready_q);
+    if (level == SYSTEM) {
+        Cp = RQ_Pop(&ready_q, SYSTEM);
+    }
+    //under PERIODIC_FIXED admission control guarantees at most one is due
+    if(Cp == NULL) {
+        Cp = Kernel_Periodic_Next();
+    }
+    if(Cp == NULL && level < NUM_LEVELS) {
+        Cp = RQ_Pop(&ready_q, level);
+    }
+    
+    if(Cp == NULL) {
+        idling = TRUE;
+        Cp = &idle_process;
+    } else {
+        Cp->state = RUNNING;
+	}
+    if(!idling) {
+        BIT_RESET(OUTPUT_PORT, IDLE_PIN);
+    }
+
+    if(PROFILE) {
+        dispatch_cycles = TCNT5 - t0;
+        if(dispatch_cycles > dispatch_cycles_max) {
+            dispatch_cycles_max = dispatch_cycles;
+        }
+    }
+}
+
+/*
+ * Puts a task that was blocked on a message back on its ready list
+ */
+static void Kernel_Unblock(PD* p)
+{
+    p->state = READY;
+    RQ_Push(&ready_q, p);
+}
+
+/*
+ * In a Send/Reply exchange the partner is almost always the right task to
+ * run next, so it gets the CPU directly if it is at least as important as
+ * the task that released it and as anything on the ready lists, and, for
+ * an RR partner, no periodic task is due. Cp likewise keeps the CPU only
+ * if Kernel_Should_Preempt() says nothing (e.g. a sleeper woken on this
+ * kernel entry) outranks it. Otherwise everything goes through Dispatch().
+ */
+static void Kernel_Msg_Switch()
+{
+    PD* p = handoff;
+    handoff = NULL;
+
+    if(Cp->state != READY && Cp->state != RUNNING) {
+        //Cp blocked, in BLOCKED_REPLY if it released a receiver
+        if(p != NULL && RQ_LEVEL(p) <= RQ_Highest(&ready_q) &&
+                (p->priority < PERIODIC || !Kernel_Periodic_Due())) {
+            Cp = p;
+            Cp->state = RUNNING;
+            return;
+        }
+    }
+    else if(p == NULL) {
+        //a Recv that found a sender waiting, or a no-op; carry on, unless
+        //a sleeper woken on this kernel entry or a periodic release is due
+        if(!Kernel_Should_Preempt()) {
+            Cp->state = RUNNING;
+            return;
+        }
+    }
+    else if(RQ_LEVEL(p) > RQ_LEVEL(Cp)) {
+        //a Reply to a lower priority sender, which just becomes ready
+        RQ_Push(&ready_q, p);
+        p = NULL;
+        if(!Kernel_Should_Preempt()) {
+            Cp->state = RUNNING;
+            return;
+        }
+    }
+    else if(RQ_LEVEL(p) <= RQ_Highest(&ready_q) &&
+            (p->priority < PERIODIC || !Kernel_Periodic_Due())) {
+        //a Reply to a sender at least as important as Cp
+        Cp->state = READY;
+        RQ_Push(&ready_q, (PD*)Cp);
+        Cp = p;
+        Cp->state = RUNNING;
+        return;
+    }
+
+    if(p != NULL) {
+        RQ_Push(&ready_q, p);
+    }
+    Dispatch();
+}
+
+/*
+ * This is the main loop of our kernel, called by Kernel_Start().
+ */
+ int num_next = 0;
+static void Kernel_Next_Request() 
+{
+    Dispatch();  /* select a new task to run */
+
+    while(1) {
+        switched_in = Elapsed;
+        if(TICKLESS) {
+            Kernel_Program_Timer();
+        }
+        if(TICKLESS || EXEC_TIMING) {
+            last_switch = Kernel_Clock();
+        }
+
+        /* activate this newly selected task */
+        CurrentSp = Cp->sp;
+        Exit_Kernel();    /* The task will be running after this */
+
+        /* if this task makes a system call, it will return to here! */
+        if(EXEC_TIMING) Kernel_Exec_Charge();
+        if(TICKLESS) Kernel_Update_Elapsed();
+        Kernel_Wake_Sleepers();
+        if(BUDGETED && Cp->priority == PERIODIC) Kernel_Charge_Budget();
+        if(Cp->priority == RR) Kernel_Charge_Slice();
+
+        /* save the Cp's stack pointer */
+        if(DEBUG) printf("Kernel_Next_Request Info:\nType: %d | Priority: %d\n", 
+                                        current_request->request_type, current_request->priority);
+        Cp->sp = CurrentSp;
+        //every switch away from a task starts here, Dispatch() or not
+        if(STACK_CHECK) Kernel_Stack_Check((PD*)Cp);
+        if(current_request == NULL) {
+            OS_Abort(NULL_REQUEST);
+        }
+		
+        switch(current_request->request_type){
+            case CREATE:
+                Kernel_Create_Task();
+                break;
+            case NEXT:
+                if(Cp->base_priority == PERIODIC && Cp->locks > 0) {
+                    OS_Abort(INVALID_LOCK_REQUEST);
+                }
+                if(Cp->overran) {
+                    //back to its own level for the next job
+                    Cp->overran = FALSE;
+                    Cp->priority = Cp->base_priority = PERIODIC;
+                }
+                if(Cp->priority == PERIODIC) {
+                    Cp->next_start = Cp->next_start + Cp->period;
+                    Cp->remaining = 0;
+                }
+                if(EXEC_TIMING) Kernel_Exec_Record((PD*)Cp);
+                num_next++;
+                Cp->state = READY;
+                if(Cp->priority == RR) {
+                    //a yield goes to the back with a new slice
+                    Kernel_RR_Gave_Up((PD*)Cp);
+                    RQ_Push(&ready_q, (PD*)Cp);
+                    Cp = NULL;
+                }
+                Dispatch();
+                break;
+            case TERMINATE:
+                /* deallocate all resources used by this task */
+                Kernel_Request_Terminate();
+                Dispatch();
+                break;
+            case TIMER_TICK:
+                //SYSTEM should never need an interrupt to switch (some timeout is a good idea?)
+                //PERIODIC should update here, and dispatch if past wcet
+                //or, under a preemptive policy, if another job was released
+                //(any periodic job, if Cp is a deferred overrun)
+                //RR is lowest priority, so dispatch immediately here
+                if(idling || Cp->priority == RR) { 
+                    Dispatch();
+                }
+                else if(Cp->priority == PERIODIC){
+                    if(Kernel_Periodic_Overrun()){
+                        Kernel_Periodic_Overrun_Handle();
+                    }
+                    else if(Cp->overran ? Kernel_Periodic_Due() :
+                            BUDGETED && Kernel_Release_Due()) {
+                        Dispatch();
+                    }
+                    else if(ready_q.bitmap & LEVEL_BIT(SYSTEM)) {
+                        //a System task woke from sleep
+                        Dispatch();
+                    }
+                }
+                else {
+                    if(DEBUG) printf("system_q: %d\nperiodic_q: %d\nrr_q: %d\n\nCp priority: %d\nCp PID: %d\n", 
+                                ready_q.level[SYSTEM].length, periodic_q.length, ready_q.level[RR].length,
+                                Cp->priority, Cp->pid);
+                }
+                break;
+            case SEND:
+				if(DEBUG) printf("SEND\n");
+				if(Cp->priority == PERIODIC) {
+					OS_Abort(INVALID_MSG_SEND_REQUEST);
+				}
+				Kernel_Request_Msg_Send();
+				if(Cp->state != READY) Kernel_Exec_Block();
+				if(Cp->priority == RR && Cp->state != READY) Kernel_RR_Gave_Up((PD*)Cp);
+				Kernel_Msg_Switch();
+				break;
+			case RECEIVE:
+				if(DEBUG) printf("Receive Mask: %d\n", current_request->msg_detail.mask);
+				if(Cp->priority == PERIODIC) {
+					OS_Abort(INVALID_MSG_RECEIVE_REQUEST);
+				}
+				Kernel_Request_Msg_Recv();
+				if(Cp->state != READY) Kernel_Exec_Block();
+				if(Cp->priority == RR && Cp->state != READY) Kernel_RR_Gave_Up((PD*)Cp);
+				Kernel_Msg_Switch();
+				break;
+			case REPLY:
+				if(DEBUG) printf("Reply\n");
+				if(Cp->priority == PERIODIC) {
+					OS_Abort(INVALID_MSG_REPLY_REQUEST);
+				}
+				Kernel_Request_Msg_Reply();
+				Kernel_Msg_Switch();
+				break;
+			case MUTEX_LOCK:
+				Kernel_Request_Mutex_Lock();
+				break;
+			case MUTEX_UNLOCK:
+				Kernel_Request_Mutex_Unlock();
+				break;
+			case SEM_WAIT:
+				Kernel_Request_Sem_Wait();
+				break;
+			case SEM_SIGNAL:
+				Kernel_Request_Sem_Signal();
+				break;
+			case EVENT_WAIT:
+				Kernel_Request_Event_Wait();
+				break;
+			case SLEEP:
+				Kernel_Request_Sleep();
+				break;
+			case INPUT_WAIT:
+				Kernel_Request_Input_Wait();
+				break;
+			case YIELD:
+				//the task woken is already on its ready list, if still more important;
+				//a periodic Cp whose wcet ran out meanwhile gets its overrun policy,
+				//as on a tick, rather than just being requeued
+				if(Cp->priority == PERIODIC && Kernel_Periodic_Overrun()) {
+					Kernel_Periodic_Overrun_Handle();
+				}
+				else if(Kernel_Should_Preempt()) {
+					Dispatch();
+				}
+				break;
+            default:
+                /* Houston! we have a problem here! */
+                if(DEBUG) printf("request type: %d\n", current_request->request_type);
+                OS_Abort(INVALID_REQUEST);
+                break;
+        }
+        current_request = NULL;
+
+        if(DEBUG) printf("exiting kernel\n");
+    } 
+}
+
+int Kernel_GetArg() {
+    return Cp->info->arg;
+}
+PID Kernel_GetPid() {
+    return Cp->pid;
+}
+
+TICK Kernel_GetElapsed() {
+	if(TICKLESS) {
+		unsigned char sreg = SREG;
+		unsigned long now, f;
+		Disable_Interrupt();
+		now = Kernel_Clock();
+		f = frozen;
+		if(Cp->priority == SYSTEM) {
+			f += now - last_switch;
+		}
+		SREG = sreg;
+		return (now - f) / CLOCKSPERTICK;
+	}
+	return Elapsed;
+}
+
+unsigned long Kernel_GetClock() {
+	return Kernel_Clock();
+}
+
+BOOL Kernel_Exec_Stats(PID pid, EXEC_STATS* stats) {
+	unsigned char sreg = SREG;
+	PD* p;
+
+	if(pid == 0 || pid > MAXTHREAD || Process[pid - 1].state == DEAD) {
+		return FALSE;
+	}
+	p = Process + (pid - 1);
+	Disable_Interrupt();
+	*stats = p->info->exec;
+	SREG = sreg;
+	stats->mean = (stats->jobs > 0) ? stats->total / stats->jobs : 0;
+	return TRUE;
+}
+
+unsigned int Kernel_Misses(PID pid) {
+	if(pid == 0 || pid > MAXTHREAD || Process[pid - 1].state == DEAD) {
+		return 0;
+	}
+	return Process[pid - 1].info->misses;
+}
+
+/*
+ * Stacks grow down, so the unused part is the run of STACK_FILL bytes
+ * at the low end.
+ */
+unsigned int Kernel_Stack_Used(PID pid) {
+	PD* p;
+	unsigned int i;
+
+	if(pid == 0 || pid > MAXTHREAD || Process[pid - 1].state == DEAD) {
+		return 0;
+	}
+	p = Process + (pid - 1);
+	for(i = 0; i < p->info->stack_size && p->info->stack[i] == STACK_FILL; i++);
+	return p->info->stack_size - i;
+}
+
+static void Kernel_Stack_Check(PD* p) {
+	unsigned char i;
+
+	for(i = 0; i < STACK_CANARY; i++) {
+		if(p->info->stack[i] != STACK_FILL) {
+			OS_Abort(STACK_OVERFLOW);
+		}
+	}
+}
+
+unsigned int Kernel_Dispatch_Cycles() {
+	return dispatch_cycles;
+}
+
+unsigned int Kernel_Dispatch_Cycles_Max() {
+	return dispatch_cycles_max;
+}
+
+/*
+ * A sender either hands its message straight to a receiver that is already
+ * waiting for it, or joins the tail of the receiver's "senders" queue.
+ */
+static void Kernel_Request_Msg_Send(){
+    PD* r;
+
+    if(current_request->msg_detail.pid == 0 || current_request->msg_detail.pid > MAXTHREAD ||
+            Process[current_request->msg_detail.pid - 1].state == DEAD) {
+        // NO MATCHING PID OR OUT OF RANGE
+        return;
+    }
+    r = Process + (current_request->msg_detail.pid - 1);
+
+    Cp->info->msg_detail.pid = current_request->msg_detail.pid;
+    Cp->info->msg_detail.msg = current_request->msg_detail.msg;
+    Cp->info->msg_detail.type = current_request->msg_detail.type;
+
+    if(DEBUG) printf("Send to: %d | Mask: %d | Type: %d\n", r->pid, r->info->msg_detail.mask, Cp->info->msg_detail.type);
+
+    //r works for Cp until it replies, at Cp's priority if that is higher
+    if(Cp->priority == SYSTEM) {
+        Kernel_Inherit(r, 1);
+    }
+
+    if(r->state == BLOCKED_RECEIVE && (r->info->msg_detail.mask & Cp->info->msg_detail.type)) {
+        *(r->info->msg_detail.msg) = *(Cp->info->msg_detail.msg);
+        r->info->msg_detail.pid = Cp->pid;
+        r->info->blocked_request->msg_detail.pid = Cp->pid;
+        Cp->state = BLOCKED_REPLY;
+        r->state = READY;
+        handoff = r;
+    }
+    else {
+        Cp->state = BLOCKED_SEND;
+        Q_Push(&r->senders, (PD*)Cp);
+    }
+}
+
+/*
+ * A receiver takes the first sender in its own queue whose type passes the
+ * mask. Only tasks that sent to Cp are looked at, so with an ANY mask this
+ * is a single pop.
+ */
+static void Kernel_Request_Msg_Recv(){
+    PD* prev = NULL;
+    PD* s = Cp->senders.front;
+
+    current_request->msg_detail.pid = 0;
+    Cp->info->msg_detail.mask = current_request->msg_detail.mask;
+    Cp->info->msg_detail.msg = current_request->msg_detail.msg;
+
+    while(s != NULL && !(s->info->msg_detail.type & Cp->info->msg_detail.mask)) {
+        prev = s;
+        s = s->next;
+    }
+    if(s == NULL) {
+        // nobody to take a message from yet, wait for Kernel_Request_Msg_Send()
+        Cp->state = BLOCKED_RECEIVE;
+        Cp->info->blocked_request = current_request;
+        return;
+    }
+    Q_Unlink(&((PD*)Cp)->senders, prev, s);
+
+    current_request->msg_detail.pid = Cp->info->msg_detail.pid = s->pid;
+    *(Cp->info->msg_detail.msg) = *(s->info->msg_detail.msg);
+    s->state = BLOCKED_REPLY;
+    Cp->state = READY;
+}
+static void Kernel_Request_Msg_Reply(){
+    PD* s;
+
+    //Rply() to a NULL process is a no-op
+    if(Cp->info->msg_detail.pid == 0 || Cp->info->msg_detail.pid > MAXTHREAD) {
+        return;
+    }
+    s = Process + (Cp->info->msg_detail.pid - 1);
+    if(s->state == BLOCKED_REPLY && s->info->msg_detail.pid == Cp->pid) {
+        *(s->info->msg_detail.msg) = current_request->msg_detail.r;
+        if(s->priority == SYSTEM) {
+            Kernel_Inherit((PD*)Cp, -1);
+        }
+        s->state = READY;
+        handoff = s;
+    }
+}
+
+static void Kernel_Inherit(PD* p, int delta)
+{
+    PRIORITY old;
+
+    while(p != NULL) {
+        old = p->priority;
+        p->boosters += delta;
+        if(p->base_priority == PERIODIC) {
+            //periodic tasks never receive, so nothing waits on them for long
+            return;
+        }
+        //ready tasks move lists; Cp, and one just made READY, are on none
+        if(p->state == READY && p != Cp && p != handoff) {
+            RQ_Remove(&ready_q, p);
+        }
+        p->priority = Kernel_Priority(p);
+        if(p->state == READY && p != Cp && p != handoff) {
+            RQ_Push(&ready_q, p);
+        }
+        if(p->priority == old) {
+            return;
+        }
+        //p itself waits on another task, which now gains or loses p
+        if(p->state == BLOCKED_SEND || p->state == BLOCKED_REPLY) {
+            p = Process + (p->info->msg_detail.pid - 1);
+        }
+        else {
+            p = NULL;
+        }
+    }
+}
+
+static PRIORITY Kernel_Priority(PD* p)
+{
+    return (p->boosters > 0 || p->ceilings > 0) ? SYSTEM : p->base_priority;
+}
+
+static void Kernel_Settle_Time()
+{
+    if(EXEC_TIMING) Kernel_Exec_Charge();
+    if(TICKLESS) Kernel_Update_Elapsed();
+    else if(EXEC_TIMING) last_switch = Kernel_Clock();
+    if(BUDGETED && Cp->priority == PERIODIC) Kernel_Charge_Budget();
+    if(Cp->priority == RR) Kernel_Charge_Slice();
+}
+
+/*
+ * TRUE if, at its current priority, Cp should give way: something more
+ * important is ready, or the tick would have switched it out
+ */
+static BOOL Kernel_Should_Preempt()
+{
+    return (ready_q.bitmap & (LEVEL_BIT(RQ_LEVEL(Cp)) - 1)) || Kernel_Tick_Needs_Switch();
 }
-static void Kernel_Request_Msg_Reply(){
-if(Process[Cp->msg_detail.pid].state == BLOCKED_REPLY) {
-					
-					*(Process[Cp->msg_detail.pid].msg_detail.msg) = current_request->msg_detail.r;
-					Process[Cp->msg_detail.pid].state = READY;
-				}
+
+/*
+ * A blocked task becomes ready. Periodic ones (only ever blocked in
+ * Task_Wait_Input()) go back to wherever a preempted job would.
+ */
+static void Kernel_Wake(PD* p)
+{
+    p->state = READY;
+    if(p->priority == PERIODIC) {
+        Kernel_Periodic_Requeue(p);
+    }
+    else {
+        RQ_Push(&ready_q, p);
+    }
+}
+
+static void Kernel_Fast_Wake(PD* p)
+{
+    if(TICKLESS && KernelActive && Cp != NULL) {
+        Kernel_Settle_Time();
+    }
+    Kernel_Wake(p);
+}
+
+static BOOL Kernel_Fast_Preempt()
+{
+    if(!KernelActive || Cp == NULL) {
+        return FALSE;
+    }
+    if(Kernel_Should_Preempt()) {
+        return TRUE;
+    }
+    if(TICKLESS) {
+        Kernel_Program_Timer();
+    }
+    return FALSE;
+}
+
+MUTEX Kernel_Mutex_Init(PRIORITY ceiling)
+{
+    unsigned char sreg = SREG;
+    MUTEX m;
+
+    Disable_Interrupt();
+    for(m = 0; m < MAXMUTEX && mutexes[m].used; m++);
+    if(m < MAXMUTEX) {
+        mutexes[m].used = TRUE;
+        mutexes[m].ceiling = ceiling;
+        mutexes[m].raised = FALSE;
+        mutexes[m].owner = NULL;
+        Q_Init(&mutexes[m].waiters, ceiling);
+        m++;
+    }
+    else {
+        m = 0;
+    }
+    SREG = sreg;
+    return m;
+}
+
+/*
+ * Whether holding mx runs p as SYSTEM. A PERIODIC ceiling keeps other
+ * periodic tasks out, which only takes raising p if one could preempt it:
+ * with PERIODIC_FIXED a periodic holder has its slot to itself.
+ */
+static BOOL Kernel_Mutex_Raises(MUTEX_CB* mx, PD* p)
+{
+    return mx->ceiling == SYSTEM ||
+           (mx->ceiling == PERIODIC && (BUDGETED || p->base_priority != PERIODIC));
+}
+
+/*
+ * Cp runs at the ceiling from the moment it holds the mutex. It is
+ * running, so on no ready list, and the new priority only matters once
+ * it is next in the kernel or the timer ISR; the time and budget it used
+ * until now are settled first, since SYSTEM stops the clock.
+ */
+BOOL Kernel_Mutex_Lock_Fast(MUTEX m)
+{
+    unsigned char sreg = SREG;
+    MUTEX_CB* mx = MUTEX_OF(m);
+    BOOL locked = FALSE;
+
+    Disable_Interrupt();
+    if(mx != NULL && mx->owner == NULL) {
+        mx->owner = (PD*)Cp;
+        mx->raised = Kernel_Mutex_Raises(mx, (PD*)Cp);
+        Cp->locks++;
+        if(mx->raised && Cp->priority != SYSTEM) {
+            Kernel_Settle_Time();
+            Cp->ceilings++;
+            Cp->priority = SYSTEM;
+            if(TICKLESS) Kernel_Program_Timer();
+        }
+        else if(mx->raised) {
+            Cp->ceilings++;
+        }
+        locked = TRUE;
+    }
+    SREG = sreg;
+    return locked || mx == NULL;
+}
+
+/*
+ * Done here unless a task is waiting, or coming down from the ceiling
+ * means Cp should be preempted
+ */
+BOOL Kernel_Mutex_Unlock_Fast(MUTEX m)
+{
+    unsigned char sreg = SREG;
+    MUTEX_CB* mx = MUTEX_OF(m);
+    BOOL done = TRUE;
+
+    Disable_Interrupt();
+    if(mx != NULL && mx->owner == Cp) {
+        if(mx->waiters.length > 0) {
+            done = FALSE;
+        }
+        else {
+            mx->owner = NULL;
+            Cp->locks--;
+            if(mx->raised) {
+                Cp->ceilings--;
+                if(Kernel_Priority((PD*)Cp) != SYSTEM) {
+                    Kernel_Settle_Time();
+                    Cp->priority = Kernel_Priority((PD*)Cp);
+                    if(TICKLESS) Kernel_Program_Timer();
+                    done = !Kernel_Should_Preempt();
+                }
+            }
+        }
+    }
+    SREG = sreg;
+    return done;
+}
+
+/*
+ * The mutex was held when Cp tried, but may have been let go since
+ */
+static void Kernel_Request_Mutex_Lock()
+{
+    MUTEX_CB* mx = MUTEX_OF(current_request->object);
+
+    if(mx == NULL) {
+        return;
+    }
+    if(mx->owner == NULL) {
+        mx->owner = (PD*)Cp;
+        mx->raised = Kernel_Mutex_Raises(mx, (PD*)Cp);
+        Cp->locks++;
+        if(mx->raised) {
+            Cp->ceilings++;
+            Cp->priority = SYSTEM;
+        }
+        return;
+    }
+    //not recursive: it would wait for itself forever
+    if(mx->owner == Cp || IS_PERIODIC(Cp)) {
+        OS_Abort(INVALID_LOCK_REQUEST);
+    }
+    Kernel_Exec_Block();
+    Cp->state = BLOCKED_LOCK;
+    Q_Push(&mx->waiters, (PD*)Cp);
+    Dispatch();
+}
+
+/*
+ * Hands the mutex to the first waiter, which goes up to the ceiling
+ * straight away, then lets Cp down from it
+ */
+static void Kernel_Request_Mutex_Unlock()
+{
+    MUTEX_CB* mx = MUTEX_OF(current_request->object);
+    PD* w;
+
+    if(mx == NULL || mx->owner != Cp) {
+        return;
+    }
+    w = Q_Pop(&mx->waiters);
+    mx->owner = w;
+    Cp->locks--;
+    if(mx->raised) {
+        Cp->ceilings--;
+        Cp->priority = Kernel_Priority((PD*)Cp);
+    }
+    if(w != NULL) {
+        mx->raised = Kernel_Mutex_Raises(mx, w);
+        w->locks++;
+        if(mx->raised) {
+            w->ceilings++;
+            w->priority = SYSTEM;
+        }
+        Kernel_Wake(w);
+    }
+    if(Kernel_Should_Preempt()) {
+        Dispatch();
+    }
+}
+
+SEMAPHORE Kernel_Semaphore_Init(unsigned int count)
+{
+    unsigned char sreg = SREG;
+    SEMAPHORE s;
+
+    Disable_Interrupt();
+    for(s = 0; s < MAXSEMAPHORE && semaphores[s].used; s++);
+    if(s < MAXSEMAPHORE) {
+        semaphores[s].used = TRUE;
+        semaphores[s].count = count;
+        Q_Init(&semaphores[s].waiters, RR);
+        s++;
+    }
+    else {
+        s = 0;
+    }
+    SREG = sreg;
+    return s;
+}
+
+BOOL Kernel_Semaphore_Wait_Fast(SEMAPHORE s)
+{
+    unsigned char sreg = SREG;
+    SEMAPHORE_CB* sem = SEMAPHORE_OF(s);
+    BOOL done = TRUE;
+
+    Disable_Interrupt();
+    if(sem != NULL) {
+        if(sem->count > 0) {
+            sem->count--;
+        }
+        else {
+            done = FALSE;
+        }
+    }
+    SREG = sreg;
+    return done;
+}
+
+BOOL Kernel_Semaphore_Signal_Fast(SEMAPHORE s)
+{
+    unsigned char sreg = SREG;
+    SEMAPHORE_CB* sem = SEMAPHORE_OF(s);
+    BOOL done = TRUE;
+
+    Disable_Interrupt();
+    if(sem != NULL) {
+        if(sem->waiters.length == 0) {
+            sem->count++;
+        }
+        else {
+            done = FALSE;
+        }
+    }
+    SREG = sreg;
+    return done;
+}
+
+static void Kernel_Request_Sem_Wait()
+{
+    SEMAPHORE_CB* sem = SEMAPHORE_OF(current_request->object);
+
+    if(sem == NULL) {
+        return;
+    }
+    if(sem->count > 0) {
+        sem->count--;
+        return;
+    }
+    if(IS_PERIODIC(Cp)) {
+        OS_Abort(INVALID_LOCK_REQUEST);
+    }
+    Kernel_Exec_Block();
+    Cp->state = BLOCKED_LOCK;
+    Q_Push(&sem->waiters, (PD*)Cp);
+    Dispatch();
+}
+
+/*
+ * A unit given back while someone waits goes straight to the first waiter
+ */
+static void Kernel_Request_Sem_Signal()
+{
+    SEMAPHORE_CB* sem = SEMAPHORE_OF(current_request->object);
+    PD* w;
+
+    if(sem == NULL) {
+        return;
+    }
+    w = Q_Pop(&sem->waiters);
+    if(w == NULL) {
+        sem->count++;
+        return;
+    }
+    Kernel_Wake(w);
+    if(Kernel_Should_Preempt()) {
+        Dispatch();
+    }
+}
+
+EVENT Kernel_Event_Init()
+{
+    unsigned char sreg = SREG;
+    EVENT e;
+
+    Disable_Interrupt();
+    for(e = 0; e < MAXEVENT && events[e].used; e++);
+    if(e < MAXEVENT) {
+        events[e].used = TRUE;
+        events[e].flags = 0;
+        Q_Init(&events[e].waiters, RR);
+        e++;
+    }
+    else {
+        e = 0;
+    }
+    SREG = sreg;
+    return e;
+}
+
+/*
+ * Runs outside the kernel, in a task or an ISR, with interrupts disabled.
+ * The kernel only runs with them disabled too, so moving a woken task
+ * onto its ready list here can't race with it.
+ */
+BOOL Kernel_Event_Set(EVENT e, unsigned int bits)
+{
+    unsigned char sreg = SREG;
+    EVENT_CB* ev = EVENT_OF(e);
+    PD* prev = NULL;
+    PD* p;
+    PD* next;
+    unsigned int set;
+    BOOL woke = FALSE;
+    BOOL preempt = FALSE;
+
+    Disable_Interrupt();
+    if(ev != NULL) {
+        ev->flags |= bits;
+        for(p = ev->waiters.front; p != NULL; p = next) {
+            next = p->next;
+            set = EVENT_MATCH(ev->flags, p->wait_bits, p->wait_mode);
+            if(set == 0) {
+                prev = p;
+                continue;
+            }
+            Q_Unlink(&ev->waiters, prev, p);
+            p->info->blocked_request->bits = set;
+            if(p->wait_mode & EVENT_CLEAR) {
+                ev->flags &= ~set;
+            }
+            Kernel_Fast_Wake(p);
+            woke = TRUE;
+        }
+        preempt = woke && Kernel_Fast_Preempt();
+    }
+    SREG = sreg;
+    return preempt;
+}
+
+void Kernel_Event_Clear(EVENT e, unsigned int bits)
+{
+    unsigned char sreg = SREG;
+    EVENT_CB* ev = EVENT_OF(e);
+
+    Disable_Interrupt();
+    if(ev != NULL) {
+        ev->flags &= ~bits;
+    }
+    SREG = sreg;
+}
+
+BOOL Kernel_Event_Wait_Fast(EVENT e, unsigned int bits, unsigned char mode, unsigned int* set)
+{
+    unsigned char sreg = SREG;
+    EVENT_CB* ev = EVENT_OF(e);
+
+    *set = 0;
+    if(ev == NULL) {
+        return TRUE;
+    }
+    Disable_Interrupt();
+    *set = EVENT_MATCH(ev->flags, bits, mode);
+    if(*set != 0 && (mode & EVENT_CLEAR)) {
+        ev->flags &= ~*set;
+    }
+    SREG = sreg;
+    return *set != 0;
+}
+
+/*
+ * The flags may have been set since the fast path looked
+ */
+static void Kernel_Request_Event_Wait()
+{
+    EVENT_CB* ev = EVENT_OF(current_request->object);
+    unsigned int set;
+
+    if(ev == NULL) {
+        current_request->bits = 0;
+        return;
+    }
+    set = EVENT_MATCH(ev->flags, current_request->bits, current_request->mode);
+    if(set != 0) {
+        if(current_request->mode & EVENT_CLEAR) {
+            ev->flags &= ~set;
+        }
+        current_request->bits = set;
+        return;
+    }
+    if(IS_PERIODIC(Cp)) {
+        OS_Abort(INVALID_LOCK_REQUEST);
+    }
+    Cp->wait_bits = current_request->bits;
+    Cp->wait_mode = current_request->mode;
+    Cp->info->blocked_request = current_request;
+    Kernel_Exec_Block();
+    Cp->state = BLOCKED_EVENT;
+    Q_Push(&ev->waiters, (PD*)Cp);
+    Dispatch();
+}
+
+static void Kernel_Request_Sleep()
+{
+    if(IS_PERIODIC(Cp)) {
+        OS_Abort(INVALID_SLEEP_REQUEST);
+    }
+    if((long)(Kernel_Clock() - current_request->wake) >= 0) {
+        return;
+    }
+    Kernel_Exec_Block();
+    Cp->wake_at = current_request->wake;
+    Kernel_Sleepers_Add((PD*)Cp);
+    Cp->state = BLOCKED_SLEEP;
+    if(Cp->priority == RR) {
+        Kernel_RR_Gave_Up((PD*)Cp);
+    }
+    Dispatch();
+}
+
+/*
+ * Like a sleep, except that Kernel_Input_Ready() can end it early, and
+ * periodic tasks may do it. The caller checked for its input with
+ * interrupts disabled and they have stayed so, so the ISR can't have
+ * come and gone in between. With PERIODIC_FIXED a periodic job waits at
+ * most until the end of its slot, which would otherwise run on unnoticed.
+ */
+static void Kernel_Request_Input_Wait()
+{
+    unsigned long wake = current_request->wake;
+    unsigned long end;
+    TICK left;
+
+    if(!BUDGETED && Cp->priority == PERIODIC && !Cp->overran) {
+        left = Cp->next_start + Cp->wcet - Elapsed;
+        if((int)left <= 0) {
+            return;
+        }
+        end = Kernel_Clock() + (unsigned long)left * CLOCKSPERTICK;
+        if((long)(end - wake) < 0) {
+            wake = end;
+        }
+    }
+    if((long)(Kernel_Clock() - wake) >= 0) {
+        return;
+    }
+    //a periodic job carries on when woken, Kernel_Exec_Block() leaves it be
+    Kernel_Exec_Block();
+    Cp->wake_at = wake;
+    Kernel_Sleepers_Add((PD*)Cp);
+    Cp->state = BLOCKED_INPUT;
+    if(Cp->priority == RR) {
+        Kernel_RR_Gave_Up((PD*)Cp);
+    }
+    Dispatch();
+}
+
+/*
+ * Runs outside the kernel, in an ISR, with interrupts disabled, and wakes
+ * the task like Kernel_Event_Set() does
+ */
+BOOL Kernel_Input_Ready(PID pid)
+{
+    unsigned char sreg = SREG;
+    PD* prev = NULL;
+    PD* p;
+    BOOL preempt = FALSE;
+
+    Disable_Interrupt();
+    if(pid != 0 && pid <= MAXTHREAD && Process[pid - 1].state == BLOCKED_INPUT) {
+        for(p = sleepers.front; p != Process + (pid - 1); p = p->next) {
+            prev = p;
+        }
+        Q_Unlink(&sleepers, prev, p);
+        Kernel_Fast_Wake(p);
+        preempt = Kernel_Fast_Preempt();
+    }
+    SREG = sreg;
+    return preempt;
+}
+
+/*
+ * Behind everyone waking at the same time or earlier
+ */
+static void Kernel_Sleepers_Add(PD* p)
+{
+    PD* prev = NULL;
+    PD* s = sleepers.front;
+
+    while(s != NULL && (long)(s->wake_at - p->wake_at) <= 0) {
+        prev = s;
+        s = s->next;
+    }
+    Q_Insert_After(&sleepers, prev, p);
+}
+
+/*
+ * Runs on every kernel entry and tick, with interrupts disabled
+ */
+static void Kernel_Wake_Sleepers()
+{
+    unsigned long now;
+    PD* p;
+
+    if(sleepers.length == 0) {
+        return;
+    }
+    now = Kernel_Clock();
+    while((p = sleepers.front) != NULL && (long)(now - p->wake_at) >= 0) {
+        Q_Pop(&sleepers);
+        Kernel_Wake(p);
+    }
 }
 
 /*
@@ -498,9 +2101,44 @@ if(Process[Cp->msg_detail.pid].state == BLOCKED_REPLY) {
  */
 static void Kernel_Request_Terminate() {
     // periodic tasks are rescheduled after termination
-    if(Cp->priority != PERIODIC){
+    if(!IS_PERIODIC(Cp)){
+        //anyone still waiting to send to this task, or for its reply,
+        //will never get a real one
+        PD* s;
+        PD_INFO* info;
+        int m;
+        while((s = Q_Pop(&((PD*)Cp)->senders)) != NULL) {
+            *(s->info->msg_detail.msg) = NO_REPLY;
+            Kernel_Unblock(s);
+        }
+        for(m = 0; m < MAXTHREAD; m++) {
+            s = Process + m;
+            if(s->state == BLOCKED_REPLY && s->info->msg_detail.pid == Cp->pid) {
+                *(s->info->msg_detail.msg) = NO_REPLY;
+                Kernel_Unblock(s);
+            }
+        }
+        //mutexes it still holds go to their next waiter
+        for(m = 0; m < MAXMUTEX; m++) {
+            if(mutexes[m].used && mutexes[m].owner == Cp) {
+                s = Q_Pop(&mutexes[m].waiters);
+                mutexes[m].owner = s;
+                if(s != NULL) {
+                    mutexes[m].raised = Kernel_Mutex_Raises(mutexes + m, s);
+                    s->locks++;
+                    if(mutexes[m].raised) {
+                        s->ceilings++;
+                        s->priority = SYSTEM;
+                    }
+                    Kernel_Wake(s);
+                }
+            }
+        }
         //This cast shushes compiler. Assuming it's ok?
+        info = Cp->info;
+        memset(info, 0, sizeof(PD_INFO));
         memset((PD*)Cp, 0, sizeof(PD));
+        Cp->info = info;
         Tasks--;
         Cp->state = DEAD;
     }
@@ -510,14 +2148,21 @@ static void Kernel_Request_Terminate() {
 void Kernel_Request(KERNEL_REQUEST_PARAM* krp) {
     if(KernelActive) {
         Disable_Interrupt();
-        Cp->request_param = *krp;
         current_request = krp;
-        current_request_copy = *krp;
-
-        Enter_Kernel();
+        Enter_Kernel_Voluntary();
     }
 }
 
+/*
+ * Same as Kernel_Request(), but for the timer ISR: the task did not
+ * expect to lose its registers, so all of them are saved.
+ */
+static void Kernel_Request_Preempt(KERNEL_REQUEST_PARAM* krp) {
+    Disable_Interrupt();
+    current_request = krp;
+    Enter_Kernel();
+}
+
 /*================
  * Interrupt Stuff
  *================
@@ -526,6 +2171,19 @@ void Kernel_Request(KERNEL_REQUEST_PARAM* krp) {
 
 static void Setup_System_Clock() 
 {
+    if(TICKLESS) {
+        //Normal mode, free running over all 16 bits at 62500 Hz.
+        //The compare match is set by Kernel_Program_Timer() instead.
+        TCCR4A = 0;
+        TCCR4B = (1<<CS42);
+        clock_overflows = 0;
+        frozen = 0;
+        last_switch = 0;
+        TCNT4 = 0;
+        TIFR4 = (1<<TOV4) | (1<<OCF4A);
+        TIMSK4 |= (1<<TOIE4);
+        return;
+    }
 
     TCCR4A = 0;
     TCCR4B = 0;  
@@ -538,11 +2196,12 @@ static void Setup_System_Clock()
     // Set TOP value (0.01 seconds)
     // OCR register is 16 bit, so max value is 65536
     // So we'll have our max period as 1 sec
-    unsigned int per_tick = 62500 * ((MSECPERTICK>1000)? 1000 : MSECPERTICK) / 1000;
+    unsigned int per_tick = CLOCKSPERTICK;
 
     if(DEBUG) printf("ms per system tick: %u\nclock ticks per system tick: %u\n", MSECPERTICK, per_tick); 
     if(DEBUG) _delay_ms(2000);
     OCR4A = per_tick;
+    clock_ticks = 0;
 
     //Enable interupt A for timer 4.
     TIMSK4 |= (1<<OCIE4A);
@@ -553,16 +2212,260 @@ static void Setup_System_Clock()
 }
 
 /*
- * Called once every system tick
+ * Timer 4 counts since boot. An overflow (or, ticking, a tick) that is
+ * pending but not yet serviced is counted if TCNT4 has already wrapped.
+ */
+static unsigned long Kernel_Clock()
+{
+    unsigned char sreg = SREG;
+    unsigned int t, ovf;
+    unsigned long ticks;
+
+    Disable_Interrupt();
+    t = TCNT4;
+    if(!TICKLESS) {
+        ticks = clock_ticks;
+        if((TIFR4 & (1<<OCF4A)) && t < CLOCKSPERTICK / 2) {
+            ticks++;
+        }
+        SREG = sreg;
+        return ticks * CLOCKSPERTICK + t;
+    }
+    ovf = clock_overflows;
+    if((TIFR4 & (1<<TOV4)) && t < 0x8000) {
+        ovf++;
+    }
+    SREG = sreg;
+    return ((unsigned long)ovf << 16) | t;
+}
+
+static void Kernel_Exec_Charge()
+{
+    Cp->info->exec_job += Kernel_Clock() - last_switch;
+}
+
+/*
+ * The job just ended. Totals saturate rather than wrap, after ~19 hours.
+ */
+static void Kernel_Exec_Record(PD* p)
+{
+    EXEC_STATS* e = &p->info->exec;
+    unsigned long t = p->info->exec_job;
+    unsigned long q = t / EXEC_BUCKET0;
+    unsigned char b = 0;
+
+    p->info->exec_job = 0;
+    if(e->jobs == 0xFFFF || e->total + t < e->total) {
+        return;
+    }
+    if(e->jobs == 0 || t < e->min) e->min = t;
+    if(t > e->max) e->max = t;
+    e->total += t;
+    e->jobs++;
+
+    while(q > 0 && b < EXEC_BUCKETS - 1) {
+        q >>= 1;
+        b++;
+    }
+    e->histogram[b]++;
+}
+
+static void Kernel_Exec_Block()
+{
+    if(EXEC_TIMING && !IS_PERIODIC(Cp)) {
+        Kernel_Exec_Record((PD*)Cp);
+    }
+}
+
+/*
+ * Tickless: called on every kernel entry. Time spent in a SYSTEM task is
+ * frozen, same as the ticking ISR not counting those ticks.
+ */
+static void Kernel_Update_Elapsed()
+{
+    unsigned long now = Kernel_Clock();
+
+    if(Cp->priority == SYSTEM) {
+        frozen += now - last_switch;
+    }
+    last_switch = now;
+    Elapsed = (now - frozen) / CLOCKSPERTICK;
+}
+
+/*
+ * Tickless: sets the compare match for the next TICK at which the kernel
+ * has something to do for the task about to run, or turns it off.
+ *  SYSTEM   -- time is frozen, so nothing
+ *  PERIODIC -- its wcet running out, or with a budget whichever comes
+ *              first of that and the next release; for a deferred
+ *              overrun, any other periodic task being ready or its own
+ *              next release
+ *  RR, IDLE -- the next periodic release, or the end of the RR slice if
+ *              another RR task is waiting
+ * and, unless Cp is SYSTEM, the first sleeper waking up if that is sooner.
+ */
+static void Kernel_Program_Timer()
+{
+    TICK next = 0;
+    TICK release;
+    BOOL armed = FALSE;
+    unsigned long now, start, target = 0;
+
+    switch(Cp->priority) {
+        case PERIODIC:
+            if(Cp->overran) {
+                //deferred, runs until anything else periodic comes up, or
+                //at most until its own next release
+                next = Cp->next_start + Cp->period;
+                if(periodic_ready.length > 0 || cyclic_ready.length > 0) {
+                    next = Elapsed + 1;
+                }
+                else if(Kernel_Periodic_Next_Release(&release) &&
+                        (int)(release + 1 - next) < 0) {
+                    next = release + 1;
+                }
+                armed = TRUE;
+                break;
+            }
+            if(!BUDGETED) {
+                next = Cp->next_start + Cp->wcet;
+            }
+            else if(!Kernel_Periodic_Next_Release(&next) ||
+                    (int)(next + 1 - (Elapsed + Cp->remaining)) > 0) {
+                next = Elapsed + Cp->remaining;
+            }
+            else {
+                next = next + 1;
+            }
+            armed = TRUE;
+            break;
+        case RR:
+        case IDLE:
+            if(Kernel_Periodic_Next_Release(&next)) {
+                //released once Elapsed passes it
+                next = next + 1;
+                armed = TRUE;
+            }
+            if(Cp->priority == RR && (ready_q.bitmap & RR_LEVEL_BITS) &&
+                    (!armed || (int)(next - (Elapsed + Cp->slice)) > 0)) {
+                next = Elapsed + Cp->slice;
+                armed = TRUE;
+            }
+            break;
+        default:
+            break;
+    }
+
+    now = Kernel_Clock();
+    if(armed && (int)(next - Elapsed) <= 0) {
+        //already due, fire as soon as we leave the kernel
+        target = now;
+    }
+    else if(armed) {
+        start = frozen + ((now - frozen) / CLOCKSPERTICK) * CLOCKSPERTICK;
+        target = start + (unsigned long)(TICK)(next - Elapsed) * CLOCKSPERTICK;
+    }
+    //a sleeper waking first, unless Cp is a System task it couldn't preempt
+    if(sleepers.length > 0 && Cp->priority != SYSTEM &&
+            (!armed || (long)(sleepers.front->wake_at - target) < 0)) {
+        target = sleepers.front->wake_at;
+        armed = TRUE;
+    }
+
+    if(!armed) {
+        TIMSK4 &= ~(1<<OCIE4A);
+        return;
+    }
+    timer_target = target;
+    OCR4A = (unsigned int)timer_target;
+    if((long)(Kernel_Clock() - timer_target) >= 0) {
+        //already due, or went by while we were setting it up
+        OCR4A = TCNT4 + 2;
+    }
+    TIFR4 = (1<<OCF4A);
+    TIMSK4 |= (1<<OCIE4A);
+}
+
+/*
+ * Mirrors the TIMER_TICK case of Kernel_Next_Request(). Cheap enough to
+ * run on every tick, so a tick that would only have returned to Cp never
+ * pays for a full context save and kernel entry.
+ *  SYSTEM   -- never preempted by a tick
+ *  PERIODIC -- only when it has overrun its wcet, or with a budget also
+ *              when another job is released; a deferred overrun whenever
+ *              another periodic task is ready
+ *  RR       -- only when something more important is ready, or its slice
+ *              is up and another RR task is waiting
+ *  IDLE     -- only when anything else is ready or a periodic task is due
+ */
+static BOOL Kernel_Tick_Needs_Switch()
+{
+    switch(Cp->priority) {
+        case SYSTEM:
+            return FALSE;
+        case PERIODIC:
+            if(Cp->overran) {
+                return Kernel_Periodic_Due() || Kernel_Periodic_Overrun();
+            }
+            if(BUDGETED) {
+                return (TICK)(Elapsed - switched_in) >= Cp->remaining || Kernel_Release_Due();
+            }
+            return !TICK_BEFORE(Elapsed, Cp->next_start + Cp->wcet);
+        case RR:
+            //anything more important, or another RR task once the slice is up
+            return (ready_q.bitmap & (LEVEL_BIT(RQ_LEVEL(Cp)) - 1)) || Kernel_Periodic_Due() ||
+                   ((TICK)(Elapsed - switched_in) >= Cp->slice && (ready_q.bitmap & RR_LEVEL_BITS));
+        default:
+            return ready_q.bitmap != 0 || Kernel_Periodic_Due();
+    }
+}
+
+/*
+ * Tickless: the high half of Kernel_Clock()
+ */
+ISR(TIMER4_OVF_vect)
+{
+    clock_overflows++;
+}
+
+/*
+ * For ISRs other than the tick: switches away from Cp, the task the ISR
+ * interrupted, the same way the tick does
+ */
+static KERNEL_REQUEST_PARAM preempt_prm;
+void Kernel_Preempt()
+{
+    if(KernelActive && current_request == NULL) {
+        preempt_prm.request_type = YIELD;
+        Kernel_Request_Preempt(&preempt_prm);
+    }
+}
+
+/*
+ * Called once every system tick, or in tickless mode whenever the compare
+ * match set by Kernel_Program_Timer() comes up
  */
 static KERNEL_REQUEST_PARAM prm;
 ISR(TIMER4_COMPA_vect)
 {
     if (KernelActive) {
+        //OCR4A only holds the low 16 bits of the target, so it also matches
+        //once per overflow before the target is reached
+        if(TICKLESS && (long)(Kernel_Clock() - timer_target) < 0) {
+            return;
+        }
         if(DEBUG) puts("-------- START TICK ---------\n");
         BIT_TOGGLE(OUTPUT_PORT, CLOCK_PIN);
-		if(Cp == NULL || Cp->priority != SYSTEM)
+        if(!TICKLESS) clock_ticks++;
+		if(!TICKLESS && (Cp == NULL || Cp->priority != SYSTEM))
 			Elapsed++;
+
+        if(!TICKLESS) Kernel_Wake_Sleepers();
+
+        //fast path: nothing to reschedule, just return to Cp
+        if(!TICKLESS && Cp != NULL && !Kernel_Should_Preempt()) {
+            return;
+        }
 		
         // Need to indicate that this is just a tick, for the likely case that 
         // the Cp doesn't need to get switched
@@ -575,10 +2478,9 @@ ISR(TIMER4_COMPA_vect)
         }
         prm.request_type = TIMER_TICK; 
         prm.priority = SYSTEM;
-        current_request_copy = prm;
 
-        //Is this going out of scope???
-        Kernel_Request(&prm);
+        //static, so it outlives this ISR while the kernel works on it
+        Kernel_Request_Preempt(&prm);
     }
         
 }
@@ -606,26 +2508,54 @@ void Kernel_Init()
     BIT_SET(OUTPUT_PORT_INIT, ERROR_PIN);
     BIT_SET(OUTPUT_PORT_INIT, DEBUG_PIN);
 
-    Q_Init(&system_q, SYSTEM);
-    Q_Init(&periodic_q, PERIODIC);
-    Q_Init(&rr_q, RR);
+    H_Init(&periodic_q);
+    H_Init(&periodic_ready);
+    switched_in = 0;
+    cyclic_length = 0;
+    cyclic_next = 0;
+    cyclic_hyperperiod = 0;
+    cyclic_base = 0;
+    Q_Init(&cyclic_ready, PERIODIC);
+    handoff = NULL;
+    RQ_Init(&ready_q);
+    memset(mutexes, 0, sizeof(mutexes));
+    memset(semaphores, 0, sizeof(semaphores));
+    memset(events, 0, sizeof(events));
+    Q_Init(&sleepers, RR);
+
+    if(PROFILE) {
+        //Timer 5 free runs at the CPU clock, so TCNT5 differences are cycle counts
+        TCCR5A = 0;
+        TCCR5B = (1<<CS50);
+        dispatch_cycles = 0;
+        dispatch_cycles_max = 0;
+    }
 
     //Create the user main task request
     KERNEL_REQUEST_PARAM prm;
     prm.request_type = CREATE;
     prm.priority = SYSTEM;
+    prm.overrun = OVERRUN_ABORT;
+    prm.quantum = 0;
+    prm.stack = 0;
     prm.code = user_main;
     prm.arg = 0;
 
     //Create system idle process
     //Shouldn't need to do any initialization? 
     memset(&idle_process, 0, sizeof(PD));
+    memset(&idle_info, 0, sizeof(PD_INFO));
+    idle_process.info = &idle_info;
+    idle_process.info->stack = idle_stack;
+    idle_process.info->stack_size = IDLESTACK;
     Kernel_Create_Task_At(&idle_process, Kernel_Idle_Task);
     idle_process.priority = IDLE;
 
     //Reminder: Clear the memory for the task on creation.
     for (x = 0; x < MAXTHREAD; x++) {
         memset(&(Process[x]),0,sizeof(PD));
+        memset(&(ProcessInfo[x]),0,sizeof(PD_INFO));
+        Process[x].info = &(ProcessInfo[x]);
         Process[x].state = DEAD;
     }
     current_request = &prm;
@@ -11,6 +11,56 @@
 
 TICK Kernel_GetElapsed();
 
+/*
+ * Timer 4 counts (62500 per second) since boot.
+ */
+unsigned long Kernel_GetClock();
+
+/*
+ * Copies the execution time statistics of task "pid", FALSE if there is no
+ * such task. Only kept when EXEC_TIMING is set in common.h.
+ */
+BOOL Kernel_Exec_Stats(PID pid, EXEC_STATS* stats);
+
+unsigned int Kernel_Misses(PID pid);
+unsigned int Kernel_Stack_Used(PID pid);
+
+/*
+ * Mutex and semaphore fast paths. They run on the caller's stack with
+ * interrupts briefly disabled, and return FALSE when the caller has to
+ * make the matching kernel request instead.
+ */
+MUTEX Kernel_Mutex_Init(PRIORITY ceiling);
+BOOL  Kernel_Mutex_Lock_Fast(MUTEX m);
+BOOL  Kernel_Mutex_Unlock_Fast(MUTEX m);
+SEMAPHORE Kernel_Semaphore_Init(unsigned int count);
+BOOL  Kernel_Semaphore_Wait_Fast(SEMAPHORE s);
+BOOL  Kernel_Semaphore_Signal_Fast(SEMAPHORE s);
+
+/*
+ * Event flags. Kernel_Event_Set() wakes the waiters it satisfies itself,
+ * so it is also safe in an ISR, and returns TRUE if one of them should
+ * preempt Cp; Kernel_Preempt() then makes that happen from an ISR.
+ */
+EVENT Kernel_Event_Init();
+BOOL  Kernel_Event_Set(EVENT e, unsigned int bits);
+void  Kernel_Event_Clear(EVENT e, unsigned int bits);
+BOOL  Kernel_Event_Wait_Fast(EVENT e, unsigned int bits, unsigned char mode, unsigned int* set);
+void  Kernel_Preempt();
+
+/*
+ * Ends the Task_Wait_Input() of task "pid", if it is in one. Same rules
+ * as Kernel_Event_Set().
+ */
+BOOL  Kernel_Input_Ready(PID pid);
+
+/*
+ * Cycles spent in the last and the slowest Dispatch(). Only counted when
+ * PROFILE is set in common.h (uses Timer 5 at the CPU clock).
+ */
+unsigned int Kernel_Dispatch_Cycles();
+unsigned int Kernel_Dispatch_Cycles_Max();
+
 /*
  * external "main" function. first task to run, and should initialize the starting tasks
  */
@@ -56,6 +106,14 @@ extern void Exit_Kernel();    /* this is the same as CSwitch() */
  */ 
 extern void Enter_Kernel();
 
+/*
+ * Same as Enter_Kernel(), but only saves what the AVR-GCC ABI requires a
+ * callee to preserve (r2-r17, r28, r29) and SREG. Used for every
+ * voluntary system call; Enter_Kernel() is kept for timer preemption,
+ * where the interrupted task expects all of its registers back.
+ */
+extern void Enter_Kernel_Voluntary();
+
 /*
  * This is how the rest of the OS submits requests to the kernel
  *
@@ -42,6 +42,15 @@ void OS_Abort(unsigned int error) {
 			case INVALID_MSG_REPLY_REQUEST:
 				printf("ERROR: INVALID_MSG_REPLY_REQUEST\n");
 				break;
+			case INVALID_SLEEP_REQUEST:
+				printf("ERROR: INVALID_SLEEP_REQUEST\n");
+				break;
+			case INVALID_LOCK_REQUEST:
+				printf("ERROR: INVALID_LOCK_REQUEST\n");
+				break;
+			case STACK_OVERFLOW:
+				printf("ERROR: STACK_OVERFLOW\n");
+				break;
 			case TIMING_VIOLATION:
 				printf("ERROR: TIMING_VIOLATION\n");
 				break;
@@ -49,6 +58,7 @@ void OS_Abort(unsigned int error) {
 				printf("ERROR: %d\n", error);
 				break;
 		}
+    uart0_flush();  //interrupts stay off from here on
     while(TRUE) {
         Blink_Pin(ERROR_PIN, error);
         _delay_ms(1000); 
@@ -68,10 +78,14 @@ void OS_Init(void) {
  *   LOWEST   -- Round-Robin (RR) tasks
  */
  
-PID Task_Create(voidfuncptr f, PRIORITY p, int arg, TICK period, TICK wcet, TICK offset) {
+PID Task_Create(voidfuncptr f, PRIORITY p, int arg, TICK period, TICK wcet, TICK offset,
+                OVERRUN_POLICY overrun, TICK quantum, unsigned int stack) {
 	KERNEL_REQUEST_PARAM prm;
     prm.request_type = CREATE;
     prm.priority = p;
+    prm.overrun = overrun;
+    prm.quantum = quantum;
+    prm.stack = stack;
     prm.code = f;
     prm.arg = arg;
 	prm.period = period;
@@ -83,17 +97,40 @@ PID Task_Create(voidfuncptr f, PRIORITY p, int arg, TICK period, TICK wcet, TICK
 }
 
 PID   Task_Create_System(voidfuncptr f, int arg) {
-    return Task_Create(f, SYSTEM, arg, 0, 0, 0);
+    return Task_Create(f, SYSTEM, arg, 0, 0, 0, OVERRUN_ABORT, 0, 0);
 }
 PID   Task_Create_RR(voidfuncptr f, int arg) {
-    return Task_Create(f, RR, arg, 0, 0, 0);
+    return Task_Create(f, RR, arg, 0, 0, 0, OVERRUN_ABORT, 0, 0);
+}
+PID   Task_Create_RR_Quantum(voidfuncptr f, int arg, TICK quantum) {
+    return Task_Create(f, RR, arg, 0, 0, 0, OVERRUN_ABORT, quantum, 0);
 }
 
 /*
- * returns 0 if not successful; otherwise a non-zero PID. -- //TODO PID 0 not valid?
+ * returns 0 if not successful, including when admission control finds the new
+ * task would conflict with an existing one; otherwise a non-zero PID.
  */
 PID   Task_Create_Period(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset) {
-    return Task_Create(f, PERIODIC, arg, period, wcet, offset);
+    return Task_Create(f, PERIODIC, arg, period, wcet, offset, OVERRUN_ABORT, 0, 0);
+}
+
+PID   Task_Create_Period_Policy(voidfuncptr f, int arg, TICK period, TICK wcet, TICK offset,
+                                OVERRUN_POLICY overrun) {
+    return Task_Create(f, PERIODIC, arg, period, wcet, offset, overrun, 0, 0);
+}
+
+/*
+ * number of jobs of a periodic task that used up their wcet
+ */
+unsigned int Task_Misses(PID id) {
+    return Kernel_Misses(id);
+}
+
+/*
+ * deepest the task's stack has been, in bytes
+ */
+unsigned int Task_Stack_Used(PID id) {
+    return Kernel_Stack_Used(id);
 }
 
 /*
@@ -127,8 +164,152 @@ PID  Task_Pid(void) {
     return Kernel_GetPid();
 }
 
+/*
+ * Execution time statistics of a task, see EXEC_STATS
+ */
+BOOL Task_Exec_Stats(PID id, EXEC_STATS* stats) {
+	return Kernel_Exec_Stats(id, stats);
+}
+
+unsigned long Task_Clock() {
+	return Kernel_GetClock();
+}
+
+void Task_SleepUntil(unsigned long clock) {
+	KERNEL_REQUEST_PARAM prm;
+	prm.request_type = SLEEP;
+	prm.wake = clock;
+	Kernel_Request(&prm);
+}
+
+void Task_Wait_Input(unsigned long clock) {
+	KERNEL_REQUEST_PARAM prm;
+	prm.request_type = INPUT_WAIT;
+	prm.wake = clock;
+	Kernel_Request(&prm);
+}
+
+void Task_Input_Ready_ISR(PID pid) {
+	if(Kernel_Input_Ready(pid)) {
+		Kernel_Preempt();
+	}
+}
+
+/*
+ * 1 TICK is MSECPERTICK * 62.5 Timer 4 counts, 1us is 1/16 of one
+ */
+void Task_Sleep(TICK t) {
+	Task_SleepUntil(Kernel_GetClock() + (unsigned long)t * MSECPERTICK * 125 / 2);
+}
+
+void Task_Sleep_us(unsigned long us) {
+	Task_SleepUntil(Kernel_GetClock() + (us + 15) / 16);
+}
+
+/*
+ * From the Timer 4 clock in both modes, so it also counts time System
+ * tasks run, which Elapsed leaves out
+ */
 unsigned int Now() {
-	return Kernel_GetElapsed() * MSECPERTICK + TCNT4/62.5; //62.5 per millisecond
+	//62.5 counts per millisecond, split up so the multiply can't overflow
+	unsigned long clock = Kernel_GetClock();
+	return (clock / 125) * 2 + (clock % 125) * 2 / 125;
+}
+
+
+MUTEX Mutex_Init(PRIORITY ceiling) {
+    return Kernel_Mutex_Init(ceiling);
+}
+
+/*
+ * Only enters the kernel if the mutex is held
+ */
+void Mutex_Lock(MUTEX m) {
+    KERNEL_REQUEST_PARAM prm;
+    if(Kernel_Mutex_Lock_Fast(m)) {
+        return;
+    }
+    prm.request_type = MUTEX_LOCK;
+    prm.object = m;
+    Kernel_Request(&prm);
+}
+
+/*
+ * Only enters the kernel if a task is waiting, or dropping the ceiling
+ * lets another task preempt the caller
+ */
+void Mutex_Unlock(MUTEX m) {
+    KERNEL_REQUEST_PARAM prm;
+    if(Kernel_Mutex_Unlock_Fast(m)) {
+        return;
+    }
+    prm.request_type = MUTEX_UNLOCK;
+    prm.object = m;
+    Kernel_Request(&prm);
+}
+
+SEMAPHORE Semaphore_Init(unsigned int count) {
+    return Kernel_Semaphore_Init(count);
+}
+
+void Semaphore_Wait(SEMAPHORE s) {
+    KERNEL_REQUEST_PARAM prm;
+    if(Kernel_Semaphore_Wait_Fast(s)) {
+        return;
+    }
+    prm.request_type = SEM_WAIT;
+    prm.object = s;
+    Kernel_Request(&prm);
+}
+
+void Semaphore_Signal(SEMAPHORE s) {
+    KERNEL_REQUEST_PARAM prm;
+    if(Kernel_Semaphore_Signal_Fast(s)) {
+        return;
+    }
+    prm.request_type = SEM_SIGNAL;
+    prm.object = s;
+    Kernel_Request(&prm);
+}
+
+
+EVENT Event_Init() {
+    return Kernel_Event_Init();
+}
+
+void Event_Set(EVENT e, unsigned int bits) {
+    KERNEL_REQUEST_PARAM prm;
+    if(Kernel_Event_Set(e, bits)) {
+        prm.request_type = YIELD;
+        Kernel_Request(&prm);
+    }
+}
+
+void Event_Set_ISR(EVENT e, unsigned int bits) {
+    if(Kernel_Event_Set(e, bits)) {
+        Kernel_Preempt();
+    }
+}
+
+void Event_Clear(EVENT e, unsigned int bits) {
+    Kernel_Event_Clear(e, bits);
+}
+
+/*
+ * Only enters the kernel if the task has to wait
+ */
+unsigned int Event_Wait(EVENT e, unsigned int bits, unsigned char mode) {
+    KERNEL_REQUEST_PARAM prm;
+    unsigned int set;
+    if(Kernel_Event_Wait_Fast(e, bits, mode, &set)) {
+        return set;
+    }
+    prm.request_type = EVENT_WAIT;
+    prm.object = e;
+    prm.bits = bits;
+    prm.mode = mode;
+    Kernel_Request(&prm);
+    return prm.bits;
 }
 
 
@@ -150,7 +331,7 @@ void Msg_Send( PID  id, MTYPE t, unsigned int *v )
 }
 PID  Msg_Recv( MASK m,           unsigned int *v )
 {
-	printf("Receive Mask: %d\n", m);
+	if(DEBUG) printf("Receive Mask: %d\n", m);
     KERNEL_REQUEST_PARAM prm;
     prm.request_type = RECEIVE;
 	prm.msg_detail.mask = m;
@@ -27,31 +27,97 @@ void OS_Init(void);
  * immediately, not until the next TICK.
  * A ready Periodic task preempts all other lower priority running tasks.
  * Periodic tasks must be scheduled conflict-free, i.e., no two periodic tasks should be
- * ready at the same time. It is the application engineer's responsibility to ensure that
- * it is the case. When a timing violation occurs, the RTOS may abort.
+ * ready at the same time. Task_Create_Period() checks this when the task is created and
+ * refuses a task that would conflict with one already admitted.
  * When a Periodic task is preempted, it is put on hold until all higher priority tasks
- * are no longer ready. However, when it is resumed later, a timing violation occurs if
- * another Periodic becomes ready, i.e., there is a timing conflict. The RTOS may abort.
+ * are no longer ready. Time does not advance for Periodic tasks while a System task runs,
+ * so this never pushes it into another Periodic task's slot.
+ * With PERIODIC_POLICY set to PERIODIC_EDF (common.h) periodic tasks may instead overlap.
+ * The ready one whose deadline, the end of its current period, comes first runs, and
+ * a newly released job with an earlier deadline preempts it. Each job may run for at
+ * most wcet TICKs; using more is a PERIODIC_OVERUSE. A task is admitted as long as
+ * the sum of wcet/period over all periodic tasks stays at most 1.
+ * PERIODIC_RM works the same way, but the ready task with the shortest period runs, so
+ * e.g. a 25 TICK sensor task preempts a 6000 TICK one without either needing an offset.
+ * A task is admitted if a response-time analysis shows every periodic task still
+ * finishes within its period.
  * System and RR tasks are first-come-first-served. They run until they terminate, block,
  * or yield. RR tasks, on the other hand, run until they expire their quantum, or are
  * pre-empted. If they are preempted, then reenter at the front of their level. If they
- * expire their quantum, then they go back to the end of their level. Currently, a quantum 
- * is defined to be 1 TICK.
+ * expire their quantum, then they go back to the end of their level. A quantum is
+ * RR_QUANTUM TICKs (common.h) unless given with Task_Create_RR_Quantum().
+ * With RR_FEEDBACK set, the RR level is itself split into RR_LEVELS levels. An RR task
+ * that expires its quantum sinks one level, where its quantum is twice as long; one that
+ * yields or blocks before that rises one. So CPU-bound tasks run less often but longer,
+ * and tasks that mostly wait on messages or I/O stay responsive.
  */
 
 PID   Task_Create_System(void (*f)(void), int arg);
 PID   Task_Create_RR(    void (*f)(void), int arg);
 
+/*
+ * Same as Task_Create_RR(), with a quantum of "quantum" TICKs (0 means RR_QUANTUM)
+ */
+PID   Task_Create_RR_Quantum(void (*f)(void), int arg, TICK quantum);
+
 /*
  * f a parameterless function to be created as a process instance
  * arg an integer argument to be assigned to this process instanace
- * period its execution period in multiples of TICKs
+ * period its execution period in multiples of TICKs, less than MAXPERIOD
  * wcet its worst-case execution time in TICKs, must be less than "period"
- * offset its start time in TICKs
+ * offset its start time in TICKs from now, less than MAXPERIOD
  * returns 0 if not successful; otherwise a non-zero PID.
+ *
+ * The task is only admitted if none of its jobs, [start, start + wcet), can
+ * ever overlap a job of an already admitted periodic task. Otherwise it is
+ * not created and 0 is returned, so conflicts show up here rather than as a
+ * TIMING_VIOLATION at runtime.
+ * Under PERIODIC_EDF and PERIODIC_RM the test is schedulability instead (see above).
  */
 PID   Task_Create_Period(void (*f)(void), int arg, TICK period, TICK wcet, TICK offset);
 
+/*
+ * Same as Task_Create_Period(), but chooses what happens when a job runs for its whole
+ * wcet without calling Task_Next(). Task_Create_Period() uses OVERRUN_ABORT.
+ *   OVERRUN_ABORT  -- OS_Abort(PERIODIC_OVERUSE)
+ *   OVERRUN_SKIP   -- the task stops, and its next job is skipped: in the next period it
+ *                     carries on from where it stopped
+ *   OVERRUN_DEFER  -- the job goes on only while no other periodic task is ready, and
+ *                     once its own next release comes, as an RR task
+ *   OVERRUN_DEMOTE -- the job goes on as an RR task
+ * In all but the first case the task is back at its own level with its next job.
+ */
+PID   Task_Create_Period_Policy(void (*f)(void), int arg, TICK period, TICK wcet, TICK offset,
+                                OVERRUN_POLICY overrun);
+
+/*
+ * Number of jobs of periodic task "id" that have used up their wcet, 0 if there is no
+ * such task.
+ */
+unsigned int Task_Misses(PID id);
+
+/*
+ * High-water mark of task "id"'s stack: the most bytes of it that have ever been in use,
+ * out of the size it was created with. 0 if there is no such task. Unused bytes hold
+ * STACK_FILL, so a value that happens to match it can read a few bytes low; leave some
+ * slack when sizing stacks from this. With STACK_CHECK, a task that reaches the last
+ * STACK_CANARY bytes is caught by OS_Abort(STACK_OVERFLOW) the next time it enters the
+ * kernel: a system call, or a tick or interrupt that preempts it. Calls that take a fast
+ * path (e.g. an uncontended Mutex_Lock()) don't.
+ */
+unsigned int Task_Stack_Used(PID id);
+
+/*
+ * The general form of all of the above. Each task gets "stack" bytes of stack from a
+ * pool of STACKPOOL bytes shared by all tasks (0 means WORKSPACE), so small tasks can be
+ * given small stacks. A stack under MINSTACK can't hold an interrupt and a context
+ * switch on top of the task, and is refused. period, wcet, offset and overrun
+ * are only for PERIODIC tasks, and quantum only for RR tasks (0 for RR_QUANTUM).
+ * Returns 0 if the task could not be created, e.g. no room in the pool.
+ */
+PID   Task_Create(void (*f)(void), PRIORITY p, int arg, TICK period, TICK wcet, TICK offset,
+                  OVERRUN_POLICY overrun, TICK quantum, unsigned int stack);
+
 /* NOTE: When a task function returns, it terminates automatically!!
  *
  * When a Periodic ask calls Task_Next(), it will resume at the beginning of its next period.
@@ -73,10 +139,15 @@ PID  Task_Pid(void);
 
 /*
  * Send-Recv-Rply is similar to QNX-style message-passing
- * Rply() to a NULL process is a no-op.
+ * Rply() to a NULL process is a no-op. If the receiver terminates before replying, the
+ * sender is released with NO_REPLY in *v.
  * See: http://www.qnx.com/developers/docs/6.5.0/index.jsp?topic=%2Fcom.qnx.doc.neutrino_sys_arch%2Fipc.html
  *
  * Note: PERIODIC tasks are not allowed to use Msg_Send() or Msg_Recv().
+ *
+ * A task that a System task is blocked on, i.e., sending to it or waiting for its reply,
+ * runs as a System task until it replies. This carries down a chain of nested Sends, so
+ * an RR server working for a System client is never held up by Periodic tasks.
  */
 void Msg_Send( PID  id, MTYPE t, unsigned int *v );
 PID  Msg_Recv( MASK m,           unsigned int *v );
@@ -95,6 +166,92 @@ void Msg_ASend( PID  id, MTYPE t, unsigned int v );
 
 
 
+/*
+ * With EXEC_TIMING set in common.h, the kernel timestamps every switch in and out of a
+ * task with Timer 4 (16us resolution) and keeps min/max/mean and a histogram of how
+ * long its jobs take (see EXEC_STATS). A job ends when a Periodic task calls Task_Next(),
+ * or when any other task blocks: on a message, mutex, semaphore, event, sleep or input.
+ * Use this to pick the wcet given to Task_Create_Period().
+ * Copies the statistics of task "id" into "stats"; returns FALSE if there is no such task.
+ */
+BOOL Task_Exec_Stats(PID id, EXEC_STATS* stats);
+
+/*
+ * Mutexes use the immediate priority ceiling protocol: while a task holds one, it runs
+ * at the mutex's ceiling, which must be at least the priority of every task that locks
+ * it. A ceiling of RR does nothing. SYSTEM runs the holder as a System task, so time
+ * stands still for Periodic tasks while it holds the mutex. PERIODIC, which a task can't
+ * be raised to, does the same, except for a Periodic holder under PERIODIC_FIXED, which
+ * has its slot to itself anyway and keeps running, and being charged, as Periodic.
+ * Locking a free mutex and unlocking one nobody waits for don't enter the kernel. A
+ * task that finds the mutex held waits, first come first served, and is handed it on
+ * unlock. Mutexes are not recursive: locking one the task already holds aborts.
+ * Periodic tasks must not wait, and must not call Task_Next() holding any mutex.
+ * Returns 0 if all MAXMUTEX mutexes are in use.
+ */
+MUTEX Mutex_Init(PRIORITY ceiling);
+void  Mutex_Lock(MUTEX m);
+void  Mutex_Unlock(MUTEX m);
+
+/*
+ * Counting semaphores. Wait takes one unit, blocking until there is one; Signal gives
+ * one back, or hands it straight to the first waiting task. Neither enters the kernel
+ * unless a task has to block or be woken. Periodic tasks may Signal but not block in
+ * Wait. Returns 0 if all MAXSEMAPHORE semaphores are in use.
+ */
+SEMAPHORE Semaphore_Init(unsigned int count);
+void      Semaphore_Wait(SEMAPHORE s);
+void      Semaphore_Signal(SEMAPHORE s);
+
+/*
+ * Event flag groups: 16 flags each. Event_Wait() returns once any (EVENT_ANY) or all
+ * (EVENT_ALL) of "bits" are set, with the ones of "bits" that were set. Or'ing in
+ * EVENT_CLEAR clears them as it returns, so no update is lost between waking and
+ * clearing. Setting never blocks: Periodic tasks may use Event_Set() and interrupt
+ * handlers Event_Set_ISR(); a task it wakes that is more important than the current
+ * one runs straight away. Periodic tasks must not wait unless the bits are already set.
+ * Event_Init() returns 0 if all MAXEVENT groups are in use.
+ */
+EVENT        Event_Init();
+void         Event_Set(EVENT e, unsigned int bits);
+void         Event_Set_ISR(EVENT e, unsigned int bits);
+void         Event_Clear(EVENT e, unsigned int bits);
+unsigned int Event_Wait(EVENT e, unsigned int bits, unsigned char mode);
+
+/*
+ * Blocking delays, in place of _delay_ms(): the caller sleeps and other tasks, or the idle
+ * task, get the CPU until it wakes. Unlike TICKs as seen by Periodic tasks, sleeping time
+ * is wall-clock time and keeps going while System tasks run.
+ *   Task_Sleep()      -- for "t" TICKs
+ *   Task_Sleep_us()   -- for "us" microseconds, in steps of 16us
+ *   Task_SleepUntil() -- until Task_Clock() reaches "clock", e.g. for a loop that
+ *                        mustn't drift: next += period; Task_SleepUntil(next);
+ * With the ticking timer, a task wakes at the first TICK after its time is up. In
+ * TICKLESS mode the timer is set for it. A woken System task waits for the running
+ * System task, like any other. Periodic tasks must not sleep.
+ */
+void Task_Sleep(TICK t);
+void Task_Sleep_us(unsigned long us);
+void Task_SleepUntil(unsigned long clock);
+
+/*
+ * Timer 4 counts (62500 per second, 16us each) since boot. Wraps after ~19 hours.
+ */
+unsigned long Task_Clock();
+
+/*
+ * For device drivers, e.g. uart2_wait(): Task_Wait_Input() blocks the caller until an
+ * interrupt handler calls Task_Input_Ready_ISR() with its pid, or until Task_Clock()
+ * reaches "clock", whichever comes first. Check for the input and call it with interrupts
+ * disabled, so the handler can't slip in between. They are enabled again when it returns,
+ * so disable them before checking for the input again.
+ * Unlike sleeping, Periodic tasks may wait here, and their job carries on when woken.
+ * Under PERIODIC_FIXED their slot keeps going while they wait, and the wait ends with the
+ * slot (its wcet) at the latest; otherwise waiting doesn't use up their wcet.
+ */
+void Task_Wait_Input(unsigned long clock);
+void Task_Input_Ready_ISR(PID pid);
+
 /*  
  * Returns the number of milliseconds since OS_Init(). Note that this number
  * wraps around after it overflows as an unsigned integer. The arithmetic
@@ -108,6 +265,8 @@ void Msg_ASend( PID  id, MTYPE t, unsigned int v );
  * behaviour.
  * Now() will wrap around every 65536 milliseconds. Therefore, for measurement
  * purposes, it should be used for durations less than 65 seconds.
+ * It is wall-clock time, ticking or TICKLESS: unlike TICKs as seen by Periodic tasks,
+ * it keeps going while System tasks run.
  */
 unsigned int Now();  // number of milliseconds since the RTOS boots.
 
@@ -31,41 +31,18 @@ void Q_Push(ProcessQ* q, PD* pd) {
 }
 
 /*
- * Cycles through Q, returning the first READY task
+ * for tasks that were preempted and must resume ahead of their level
  */
-PD* Q_Pop_Ready(ProcessQ* q) {
-    if(DEBUG) puts("|\n|\n");
-	if(DEBUG) printf("Q Pop Ready\n");
-	if(DEBUG) print_queue(q);
-	
-	PD* prev = NULL;
-    PD* cur = q->front;
-	
-	while(cur != NULL) {
-		if(cur->state == READY) {
-			q->length--;
-			
-			if(q->front->pid == cur->pid) {
-				q->front = cur->next;
-			}
-			if(q->back->pid == cur->pid) {
-				q->back = prev;
-			}
-			if(prev != NULL) {
-				prev->next = cur->next;
-			}
-			break;
-		}
-		prev = cur;
-		cur = cur->next;
-	}
-	if(cur != NULL) {
-		if(DEBUG) printf("Pop %d\n", cur->pid);
-	} else {
-		if(DEBUG) printf("Pop nothing\n");
-	}
-    if(DEBUG) puts("|\n|\n");
-	return cur;
+void Q_Push_Front(ProcessQ* q, PD* pd) {
+    if (q->length == 0) {
+        pd->next = NULL;
+        q->back = pd;
+    }
+    else {
+        pd->next = q->front;
+    }
+    q->front = pd;
+    q->length++;
 }
 
 void print_queue(ProcessQ* q) {
@@ -104,60 +81,187 @@ PD* Q_Pop(ProcessQ* q) {
 PD* Q_Peek(ProcessQ* q){
     return q->front;
 }
+
 /*
- * for periodic tasks
- * inserts at the appropriate point in the q
+ * Removes pd from q, given the task in front of it (NULL if pd is the front)
  */
-void Q_Insert(ProcessQ* q, PD* pd) {
-    if(DEBUG) puts("|\n|\n");
-    if(DEBUG) printf("Q Insert\n");
-    if(DEBUG) print_queue(q);
-	pd->next = NULL;
-    if (q->length == 0) {
-        q->front = pd;
-        q->back = pd;
+void Q_Unlink(ProcessQ* q, PD* prev, PD* pd) {
+    if(prev == NULL) {
+        q->front = pd->next;
     }
-    else if(pd->next_start < q->front->next_start){
+    else {
+        prev->next = pd->next;
+    }
+    if(q->back == pd) {
+        q->back = prev;
+    }
+    pd->next = NULL;
+    q->length--;
+}
+
+/*
+ * Links pd in after prev, or at the front if prev is NULL. O(1), for
+ * lists kept in order by the caller.
+ */
+void Q_Insert_After(ProcessQ* q, PD* prev, PD* pd) {
+    if(prev == NULL) {
         pd->next = q->front;
         q->front = pd;
     }
     else {
-        PD* prev = q->front;
-		PD* cur = q->front->next;
-
-        PD* spot = NULL;
-	    	
-		while(cur != NULL) {
-			if(pd->next_start < cur->next_start) {
-                spot =  prev;
-                break;
-			}
-            prev = cur;
-			cur = cur->next;
-		}
-        if(spot == NULL){
-            q->back->next = pd;
-            q->back = pd;
-        }
-        else{
-			pd->next = spot->next;
-            spot->next = pd;
-        }
+        pd->next = prev->next;
+        prev->next = pd;
+    }
+    if(pd->next == NULL) {
+        q->back = pd;
     }
     q->length++;
-    if(DEBUG) puts("|\n|\n");
 }
-unsigned int Q_CountScheduledTasks(ProcessQ* q, unsigned int elapsed){
-    int count = 0;
-    PD* p = q->front;
-    while(p != NULL){
-        if(p->next_start < elapsed){
-            count++;
+/*
+ * Binary min-heap of periodic tasks ordered by a TICK key given on insert
+ * (next_start for releases, the deadline for EDF), compared across the
+ * wrap with TICK_BEFORE(). The heap lives in an array, so the children of
+ * slot i are 2i+1 and 2i+2.
+ */
+ReleaseQ* H_Init(ReleaseQ* h) {
+    h->length = 0;
+    return h;
+}
+
+static void H_Swap(ReleaseQ* h, unsigned int a, unsigned int b) {
+    HEAP_ENTRY tmp = h->heap[a];
+    h->heap[a] = h->heap[b];
+    h->heap[b] = tmp;
+}
+
+/*
+ * for periodic tasks
+ * O(log n): the new task bubbles up from the last slot
+ */
+void H_Insert(ReleaseQ* h, PD* pd, TICK key) {
+    unsigned int i = h->length++;
+    h->heap[i].key = key;
+    h->heap[i].pd = pd;
+    while(i > 0 && TICK_BEFORE(h->heap[i].key, h->heap[(i - 1) / 2].key)) {
+        H_Swap(h, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+/*
+ * Removes and returns the task with the smallest key.
+ * O(log n): the last slot moves to the root and sinks down
+ */
+PD* H_Pop(ReleaseQ* h) {
+    unsigned int i = 0;
+    unsigned int c;
+    PD* ret;
+
+    if(h->length == 0)
+        return NULL;
+    ret = h->heap[0].pd;
+    h->heap[0] = h->heap[--h->length];
+
+    while((c = 2 * i + 1) < h->length) {
+        if(c + 1 < h->length && TICK_BEFORE(h->heap[c + 1].key, h->heap[c].key)) {
+            c++;
         }
-        p = p->next;
+        if(!TICK_BEFORE(h->heap[c].key, h->heap[i].key)) {
+            break;
+        }
+        H_Swap(h, i, c);
+        i = c;
+    }
+    return ret;
+}
+
+PD* H_Peek(ReleaseQ* h) {
+    return (h->length > 0) ? h->heap[0].pd : NULL;
+}
+
+/*
+ * Key of the root; only meaningful if the heap is not empty
+ */
+TICK H_Peek_Key(ReleaseQ* h) {
+    return h->heap[0].key;
+}
+
+/*
+ * lowest_bit[n] is the index of the lowest set bit of the nibble n, or 4 if
+ * n is 0. Two lookups cover the 8-bit ready bitmap.
+ */
+static const unsigned char lowest_bit[16] = {
+    4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+};
+
+ReadyQ* RQ_Init(ReadyQ* rq) {
+    int l;
+    for (l = 0; l < NUM_LEVELS; l++) {
+        Q_Init(&rq->level[l], l);
+    }
+    rq->bitmap = 0;
+
+    return rq;
+}
+
+/*
+ * Makes pd runnable at the back of its level
+ */
+void RQ_Push(ReadyQ* rq, PD* pd) {
+    Q_Push(&rq->level[RQ_LEVEL(pd)], pd);
+    rq->bitmap |= LEVEL_BIT(RQ_LEVEL(pd));
+}
+
+/*
+ * Makes pd runnable at the front of its level
+ */
+void RQ_Push_Front(ReadyQ* rq, PD* pd) {
+    Q_Push_Front(&rq->level[RQ_LEVEL(pd)], pd);
+    rq->bitmap |= LEVEL_BIT(RQ_LEVEL(pd));
+}
+
+/*
+ * Pops the first task of a level. Everything in a ready list is READY, so
+ * this never has to skip anything.
+ */
+PD* RQ_Pop(ReadyQ* rq, unsigned char level) {
+    PD* ret = Q_Pop(&rq->level[level]);
+    if (rq->level[level].length == 0) {
+        rq->bitmap &= ~LEVEL_BIT(level);
     }
-    return count;
+    return ret;
 }
 
+/*
+ * Takes a READY task off its level, wherever it is in the list. O(n), only
+ * needed when a ready task's priority changes.
+ */
+void RQ_Remove(ReadyQ* rq, PD* pd) {
+    unsigned char level = RQ_LEVEL(pd);
+    PD* prev = NULL;
+    PD* p = rq->level[level].front;
 
+    while(p != NULL && p != pd) {
+        prev = p;
+        p = p->next;
+    }
+    if(p == NULL) {
+        return;
+    }
+    Q_Unlink(&rq->level[level], prev, pd);
+    if (rq->level[level].length == 0) {
+        rq->bitmap &= ~LEVEL_BIT(level);
+    }
+}
 
+/*
+ * Returns the highest priority (lowest numbered) non-empty level,
+ * or NUM_LEVELS if nothing is ready.
+ */
+unsigned char RQ_Highest(ReadyQ* rq) {
+    unsigned char l = lowest_bit[rq->bitmap & 0x0F];
+    if (l == 4) {
+        l = 4 + lowest_bit[rq->bitmap >> 4];
+    }
+    return (l < NUM_LEVELS) ? l : NUM_LEVELS;
+}
@@ -3,49 +3,138 @@
 
 #include "common.h"
 
+typedef struct ProcessDescriptor PD;
+typedef struct ProcessInfo PD_INFO;
+
+typedef struct ProcessQueue {
+    PD* front;
+    PD* back;
+    unsigned char queue_type;   /* PRIORITY */
+    unsigned char length;
+} ProcessQ;
+
 /**
   * Each task is represented by a process descriptor, which contains all
-  * relevant information about this task. For convenience, we also store
-  * the task's stack, i.e., its workspace, in here.
+  * relevant information about this task. It is split in two: the PD
+  * itself holds what the scheduler and the queues look at on every
+  * switch and tick, and its PD_INFO what is only needed at creation,
+  * for messages, or for statistics. Enums are kept in a byte each, since
+  * avr-gcc makes them int-sized.
   */
-typedef struct ProcessDescriptor 
+struct ProcessDescriptor 
 {
-    volatile unsigned char *sp;   /* stack pointer into the "workSpace" */
-    unsigned char workSpace[WORKSPACE]; 
-    volatile PROCESS_STATE state;
-    voidfuncptr  code;   /* function to be executed as a task */
-    PRIORITY priority;
-    int arg;
-    PID pid;
-    KERNEL_REQUEST_PARAM request_param; //Any reason to store this here?
+    volatile unsigned char *sp;   /* stack pointer into info->stack */
     struct ProcessDescriptor* next;
-	MESSAGE msg_detail;
+    volatile unsigned char state; /* PROCESS_STATE */
+    unsigned char priority;       /* PRIORITY, raised to SYSTEM while "boosters" > 0 */
+    unsigned char base_priority;  /* PRIORITY it was created with */
+    PID pid;
+    PD_INFO* info;                /* fixed for the slot, survives termination */
+
+	// Tasks BLOCKED_SEND on this one, linked through their "next" field
+	ProcessQ senders;
+	// SYSTEM tasks blocked sending to this one or waiting for its reply
+	unsigned char boosters;
+	// mutexes held that raise it to SYSTEM, and all mutexes held
+	unsigned char ceilings;
+	unsigned char locks;
+	// while BLOCKED_SLEEP, the Timer 4 count it wakes up at
+	unsigned long wake_at;
+	// while BLOCKED_EVENT, the flags and mode it waits for
+	unsigned int wait_bits;
+	unsigned char wait_mode;
 	
+	// Only used for RR tasks
+	TICK slice;     //TICKs left of the current slice, 0 once used up
+	unsigned char rr_level; //feedback level, 0 unless RR_FEEDBACK
+
 	// Only used for periodic tasks
-	TICK remaining; //remaining allowed execution time
+	TICK remaining; //remaining allowed execution time of the current job (EDF)
 	TICK next_start;//tick at which this task is next scheduled
-	
+	unsigned char cyclic;  //released from the cyclic executive table, not the heap
+	unsigned char overran; //the current job used up its wcet; DEMOTE runs it at RR meanwhile
     TICK wcet;
     TICK period;
-    TICK offset;
-} PD;
+};
 
-typedef struct ProcessQueue {
-    PD* front;
-    PD* back;
-    PRIORITY queue_type;
+struct ProcessInfo
+{
+    unsigned char *stack;         /* stack_size bytes from the kernel's stack pool */
+    unsigned int stack_size;
+    voidfuncptr  code;   /* function to be executed as a task */
+    int arg;
+	MESSAGE msg_detail;
+	// The task's own request while blocked, so results can be written back
+	KERNEL_REQUEST_PARAM* blocked_request;
+
+	// Only used for RR tasks
+	TICK quantum;   //time slice at feedback level 0
+
+	// Only used for periodic tasks
+	unsigned char overrun_policy; //OVERRUN_POLICY
+	unsigned int misses; //jobs that used up their wcet
+
+	// Only used if EXEC_TIMING
+	unsigned long exec_job; //Timer 4 counts run so far in the current job
+	EXEC_STATS exec;
+};
+
+/*
+ * Ready tasks are kept in one intrusive list per priority level, and only
+ * READY tasks are ever linked into them. Bit n of "bitmap" is set iff
+ * level[n] is non-empty, so the highest ready level is found with a table
+ * lookup rather than a walk over every descriptor.
+ * With RR_FEEDBACK the RR priority is split into RR_LEVELS lists, the
+ * feedback level of a task picking its list.
+ */
+#define RR_SUBLEVELS  (RR_FEEDBACK ? RR_LEVELS : 1)
+#define NUM_LEVELS    (IDLE + RR_SUBLEVELS - 1)  // one ready list per level (max 8)
+#define LEVEL_BIT(l)  (1 << (l))
+#define RR_LEVEL_BITS (((1 << RR_SUBLEVELS) - 1) << RR)
+#define RQ_LEVEL(pd)  ((pd)->priority == RR ? RR + (pd)->rr_level : (pd)->priority)
+
+typedef struct ReadyQueue {
+    ProcessQ level[NUM_LEVELS];
+    unsigned char bitmap;
+} ReadyQ;
+
+/*
+ * Periodic tasks as a binary min-heap on a TICK key: next_start for tasks
+ * waiting for their next release, the deadline for ready tasks under EDF.
+ * Inserting is O(log n) and the smallest key is always heap[0].
+ */
+typedef struct heap_entry {
+    TICK key;
+    PD* pd;
+} HEAP_ENTRY;
+
+typedef struct ReleaseQueue {
+    HEAP_ENTRY heap[MAXTHREAD];
     unsigned int length;
-} ProcessQ;
+} ReleaseQ;
     
     
 ProcessQ* Q_Init(ProcessQ* q, PRIORITY type);
 void Q_Push(ProcessQ* q, PD* pd);
-PD* Q_Pop_Ready(ProcessQ* q);
+void Q_Push_Front(ProcessQ* q, PD* pd);
 PD* Q_Pop(ProcessQ* q);
 PD* Q_Peek(ProcessQ* q);
-void Q_Insert(ProcessQ* q, PD* pd);
+void Q_Unlink(ProcessQ* q, PD* prev, PD* pd);
+void Q_Insert_After(ProcessQ* q, PD* prev, PD* pd);
 void print_queue(ProcessQ* q);
-unsigned int Q_CountScheduledTasks(ProcessQ* q, unsigned int elapsed);
+
+ReadyQ* RQ_Init(ReadyQ* rq);
+void RQ_Push(ReadyQ* rq, PD* pd);
+void RQ_Push_Front(ReadyQ* rq, PD* pd);
+PD* RQ_Pop(ReadyQ* rq, unsigned char level);
+void RQ_Remove(ReadyQ* rq, PD* pd);
+unsigned char RQ_Highest(ReadyQ* rq);
+
+ReleaseQ* H_Init(ReleaseQ* h);
+void H_Insert(ReleaseQ* h, PD* pd, TICK key);
+PD* H_Pop(ReleaseQ* h);
+PD* H_Peek(ReleaseQ* h);
+TICK H_Peek_Key(ReleaseQ* h);
 
 
 #endif
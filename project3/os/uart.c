@@ -1,5 +1,6 @@
 
 #include "uart.h"
+#include "os.h"
 /* http://www.ermicro.com/blog/?p=325 */
 
 FILE uart0_output = (FILE)FDEV_SETUP_STREAM(uart0_putc, NULL, _FDEV_SETUP_WRITE);
@@ -10,11 +11,250 @@ FILE uart1_input = (FILE)FDEV_SETUP_STREAM(NULL, uart1_getc_stream, _FDEV_SETUP_
 /* http://www.cs.mun.ca/~rod/Winter2007/4723/notes/serial/serial.html */
 
 
-static volatile uint8_t uart1_buffer[UART_BUFFER_SIZE];
-static volatile uint8_t uart1_buffer_index;
+/*
+ * A receive queue. The port's RX interrupt adds at "head", tasks consume
+ * from "tail", and each index is only written by one side. One slot is
+ * kept empty to tell full from empty.
+ */
+typedef struct uart_rx {
+    volatile uint8_t* buf;
+    uint8_t mask;       // size - 1
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    volatile unsigned int overruns;
+    volatile unsigned int frame_errors;
+    volatile uint8_t want;  // bytes "waiter" is blocked for, 0 if none
+    PID waiter;
+} UART_RX;
+
+static volatile uint8_t uart1_rx_buf[UART1_RX_SIZE];
+static volatile uint8_t uart2_rx_buf[UART2_RX_SIZE];
+static UART_RX uart1_rx = { uart1_rx_buf, UART1_RX_SIZE - 1 };
+static UART_RX uart2_rx = { uart2_rx_buf, UART2_RX_SIZE - 1 };
+
+static uint8_t uart_rx_count(UART_RX* u)
+{
+    return (uint8_t)(u->head - u->tail) & u->mask;
+}
+
+static uint8_t uart_rx_peek(UART_RX* u, uint8_t index)
+{
+    if(index >= uart_rx_count(u)) {
+        return 0;
+    }
+    return u->buf[(u->tail + index) & u->mask];
+}
+
+static void uart_rx_consume(UART_RX* u, uint8_t n)
+{
+    uint8_t count = uart_rx_count(u);
+
+    if(n > count) n = count;
+    u->tail = (u->tail + n) & u->mask;
+}
+
+static uint8_t uart_rx_read(UART_RX* u, uint8_t* data, uint8_t size)
+{
+    uint8_t n = uart_rx_count(u);
+    uint8_t i;
+
+    if(size < n) n = size;
+    for(i = 0; i < n; i++) {
+        data[i] = u->buf[(u->tail + i) & u->mask];
+    }
+    u->tail = (u->tail + n) & u->mask;
+    return n;
+}
+
+/*
+ * The counters are two bytes, so read them with the ISR held off
+ */
+static unsigned int uart_rx_counter(volatile unsigned int* counter)
+{
+    uint8_t sreg = SREG;
+    unsigned int v;
+
+    cli();
+    v = *counter;
+    SREG = sreg;
+    return v;
+}
+
+/*
+ * Body of the RX interrupts. The error flags are from UCSRnA, which has
+ * to be read before UDRn.
+ */
+static void uart_rx_isr(UART_RX* u, BOOL frame_error, BOOL data_overrun, uint8_t c)
+{
+    uint8_t next = (u->head + 1) & u->mask;
+
+    if(data_overrun) {
+        u->overruns++;      // at least one byte before this one was lost
+    }
+    if(frame_error) {
+        u->frame_errors++;
+        return;
+    }
+    if(next == u->tail) {
+        u->overruns++;
+        return;
+    }
+    u->buf[u->head] = c;
+    u->head = next;
+    if(u->want != 0 && uart_rx_count(u) >= u->want) {
+        u->want = 0;
+        Task_Input_Ready_ISR(u->waiter);
+    }
+}
+
+/*
+ * 62.5 Timer 4 counts per millisecond
+ */
+static uint8_t uart_rx_wait(UART_RX* u, uint8_t num_bytes, unsigned int timeout_ms)
+{
+    uint8_t sreg = SREG;
+    unsigned long until = Task_Clock() + (unsigned long)timeout_ms * 125 / 2;
+    uint8_t ok;
+
+    cli();
+    //one waiter per port; a second one gets FALSE rather than taking the slot
+    if(uart_rx_count(u) < num_bytes && u->want == 0) {
+        u->want = num_bytes;
+        u->waiter = Task_Pid();
+        Task_Wait_Input(until);
+        //returns with interrupts enabled
+        cli();
+        if(u->waiter == Task_Pid()) {
+            u->want = 0;
+        }
+    }
+    ok = uart_rx_count(u) >= num_bytes;
+    SREG = sreg;
+    return ok;
+}
+
+/*
+ * A transmit queue. Tasks add at "head", the port's UDRE interrupt takes
+ * from "tail". Several tasks may write to one port and preempt each other,
+ * so adding, and setting UDRIE (which the interrupt clears), is done with
+ * interrupts disabled. One slot is kept empty to tell full from empty.
+ */
+typedef struct uart_tx {
+    volatile uint8_t* ucsra;
+    volatile uint8_t* ucsrb;
+    volatile uint8_t* udr;
+    uint8_t udre;       // UDREn in UCSRnA
+    uint8_t udrie;      // UDRIEn in UCSRnB
+    volatile uint8_t buf[UART_TX_SIZE];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+} UART_TX;
+
+static UART_TX uart0_tx = { &UCSR0A, &UCSR0B, &UDR0, UDRE0, UDRIE0 };
+static UART_TX uart1_tx = { &UCSR1A, &UCSR1B, &UDR1, UDRE1, UDRIE1 };
+static UART_TX uart2_tx = { &UCSR2A, &UCSR2B, &UDR2, UDRE2, UDRIE2 };
+
+static uint8_t uart_tx_space(UART_TX* u)
+{
+    return (uint8_t)(u->tail - u->head - 1) & (UART_TX_SIZE - 1);
+}
+
+/*
+ * Sends the oldest queued byte by polling, for when the interrupt can't
+ */
+static void uart_tx_poll(UART_TX* u)
+{
+    while(!(*u->ucsra & (1 << u->udre)));
+    *u->udr = u->buf[u->tail];
+    u->tail = (u->tail + 1) & (UART_TX_SIZE - 1);
+}
+
+/*
+ * Sends everything queued by polling, with the interrupt off so the two
+ * don't both take from "tail"
+ */
+static void uart_tx_drain(UART_TX* u)
+{
+    uint8_t sreg = SREG;
+
+    cli();
+    *u->ucsrb &= ~(1 << u->udrie);
+    while(u->head != u->tail) {
+        uart_tx_poll(u);
+    }
+    SREG = sreg;
+}
 
-static volatile uint8_t uart2_buffer[UART_BUFFER_SIZE];
-static volatile uint8_t uart2_buffer_index;
+/*
+ * Queues all "size" bytes of "data" in one go, waiting for room for them
+ * if need be, so another writer's bytes can't end up in between. With
+ * interrupts enabled the wait can be preempted; with them disabled (in the
+ * kernel, or OS_Abort) nothing else will drain the queue, so it is drained
+ * here. size must be less than UART_TX_SIZE.
+ */
+static void uart_tx_send(UART_TX* u, const uint8_t* data, uint8_t size)
+{
+    uint8_t sreg;
+    uint8_t i;
+
+    for(;;) {
+        sreg = SREG;
+        cli();
+        //checked with interrupts off, another writer may have filled it
+        if(uart_tx_space(u) >= size) {
+            break;
+        }
+        SREG = sreg;
+        if(!(sreg & (1 << SREG_I))) {
+            uart_tx_poll(u);
+        }
+    }
+    for(i = 0; i < size; i++) {
+        u->buf[u->head] = data[i];
+        u->head = (u->head + 1) & (UART_TX_SIZE - 1);
+    }
+    *u->ucsrb |= (1 << u->udrie);
+    SREG = sreg;
+}
+
+static void uart_tx_put(UART_TX* u, uint8_t c)
+{
+    uart_tx_send(u, &c, 1);
+}
+
+static uint8_t uart_tx_write(UART_TX* u, const uint8_t* data, uint8_t size)
+{
+    uint8_t sreg = SREG;
+    uint8_t n;
+    uint8_t i;
+
+    cli();
+    n = uart_tx_space(u);
+    if(size < n) n = size;
+    for(i = 0; i < n; i++) {
+        u->buf[u->head] = data[i];
+        u->head = (u->head + 1) & (UART_TX_SIZE - 1);
+    }
+    if(n > 0) {
+        *u->ucsrb |= (1 << u->udrie);
+    }
+    SREG = sreg;
+    return n;
+}
+
+/*
+ * Body of the UDRE interrupts: the data register is empty, send the next
+ * byte, or stop the interrupt once the queue is.
+ */
+static void uart_tx_isr(UART_TX* u)
+{
+    if(u->head == u->tail) {
+        *u->ucsrb &= ~(1 << u->udrie);
+        return;
+    }
+    *u->udr = u->buf[u->tail];
+    u->tail = (u->tail + 1) & (UART_TX_SIZE - 1);
+}
 
 void uart0_init() {
 	
@@ -35,8 +275,15 @@ void uart0_putc(char c, FILE *stream) {
     if (c == '\n') {
         uart0_putc('\r', stream);
     }
-    loop_until_bit_is_set(UCSR0A, UDRE0);
-    UDR0 = c;
+    uart_tx_put(&uart0_tx, c);
+}
+
+/**
+ * Sends everything queued for uart0 by polling. For when interrupts are
+ * going to stay disabled, e.g. OS_Abort.
+ */
+void uart0_flush(void) {
+    uart_tx_drain(&uart0_tx);
 }
 
 char uart0_getc(FILE *stream) {
@@ -47,48 +294,44 @@ char uart0_getc(FILE *stream) {
 void uart1_init(uint16_t ubrr_value) {
     	
 	// For Bluetooth
+	uart_tx_drain(&uart1_tx);   // anything queued goes out at the old rate
 	UBRR1L = (uint8_t) ubrr_value;
 	UBRR1H = (ubrr_value>>8);
 	
 	UCSR1B = (1<<TXEN1)|(1<<RXEN1)|(1<<RXCIE1);
 	
-    uart1_buffer_index = 0;
+    uart1_rx.tail = uart1_rx.head;
 }
 
 void uart2_init(uint16_t ubrr_value) {
     	
 	// For Roomba
+	uart_tx_drain(&uart2_tx);   // anything queued goes out at the old rate
 	UBRR2L = (uint8_t) ubrr_value;
 	UBRR2H = (ubrr_value>>8);
 	
 	UCSR2B = (1<<TXEN2)|(1<<RXEN2)|(1<<RXCIE2);
 	
-    uart2_buffer_index = 0;
+    uart2_rx.tail = uart2_rx.head;
 }
 
 
 
 /**
  * Transmit one byte
- * NOTE: This function uses busy waiting
+ * NOTE: This function only waits if the transmit queue is full
  *
  * @param byte data to trasmit
  */
 void uart1_putc(char byte)
 {
-    /* wait for empty transmit buffer */
-    //while (!( UCSR1A & (UDRE1)));
-	while (!( UCSR1A & (1 << UDRE1)));
-
-    /* Put data into buffer, sends the data */
-    UDR1 = byte;
+    uart_tx_put(&uart1_tx, byte);
 }
 void uart1_putc_stream(char c, FILE *stream) {
     if (c == '\n') {
         uart1_putc_stream('\r', stream);
     }
-    loop_until_bit_is_set(UCSR1A, UDRE1);
-    UDR1 = c;
+    uart_tx_put(&uart1_tx, c);
 }
 
 char uart1_getc_stream(FILE *stream) {
@@ -98,66 +341,137 @@ char uart1_getc_stream(FILE *stream) {
 
 void uart2_putc(char byte)
 {
-    /* wait for empty transmit buffer */
-    //while (!( UCSR1A & (UDRE1)));
-	while (!( UCSR2A & (1 << UDRE2)));
+    uart_tx_put(&uart2_tx, byte);
+}
+
+uint8_t uart0_write(const uint8_t* data, uint8_t size)
+{
+    return uart_tx_write(&uart0_tx, data, size);
+}
+
+uint8_t uart1_write(const uint8_t* data, uint8_t size)
+{
+    return uart_tx_write(&uart1_tx, data, size);
+}
+
+uint8_t uart2_write(const uint8_t* data, uint8_t size)
+{
+    return uart_tx_write(&uart2_tx, data, size);
+}
+
+void uart0_send(const uint8_t* data, uint8_t size)
+{
+    uart_tx_send(&uart0_tx, data, size);
+}
+
+void uart1_send(const uint8_t* data, uint8_t size)
+{
+    uart_tx_send(&uart1_tx, data, size);
+}
+
+void uart2_send(const uint8_t* data, uint8_t size)
+{
+    uart_tx_send(&uart2_tx, data, size);
+}
+
+uint8_t uart0_tx_space(void)
+{
+    return uart_tx_space(&uart0_tx);
+}
 
-    /* Put data into buffer, sends the data */
-    UDR2 = byte;
+uint8_t uart1_tx_space(void)
+{
+    return uart_tx_space(&uart1_tx);
+}
+
+uint8_t uart2_tx_space(void)
+{
+    return uart_tx_space(&uart2_tx);
 }
 
 /**
- * Receive a single byte from the receive buffer
+ * Look at a received byte without consuming it
  *
- * @param index
+ * @param index 0 for the oldest byte waiting
  *
- * @return
+ * @return the byte, 0 if fewer than index + 1 are waiting
  */
-uint8_t uart1_get_byte(int index)
+uint8_t uart1_peek(uint8_t index)
 {
-    if (index < UART_BUFFER_SIZE)
-    {
-        return uart1_buffer[index];
-    }
-    return 0;
+    return uart_rx_peek(&uart1_rx, index);
 }
 
-uint8_t uart2_get_byte(int index)
+uint8_t uart2_peek(uint8_t index)
 {
-    if (index < UART_BUFFER_SIZE)
-    {
-        return uart2_buffer[index];
-    }
-    return 0;
+    return uart_rx_peek(&uart2_rx, index);
 }
 
 /**
- * Get the number of bytes received on UART
+ * Get the number of bytes received on UART and not yet consumed
  *
- * @return number of bytes received on UART
+ * @return number of bytes waiting
  */
 uint8_t uart1_bytes_received(void)
 {
-    return uart1_buffer_index;
+    return uart_rx_count(&uart1_rx);
 }
 
 uint8_t uart2_bytes_received(void)
 {
-    return uart2_buffer_index;
+    return uart_rx_count(&uart2_rx);
 }
 
 /**
- * Prepares UART to receive another payload
- *
+ * Drops the oldest n received bytes, or all of them if fewer are waiting
  */
-void uart1_reset_receive(void)
+void uart1_consume(uint8_t n)
 {
-    uart1_buffer_index = 0;
+    uart_rx_consume(&uart1_rx, n);
 }
 
-void uart2_reset_receive(void)
+void uart2_consume(uint8_t n)
 {
-    uart2_buffer_index = 0;
+    uart_rx_consume(&uart2_rx, n);
+}
+
+uint8_t uart1_read(uint8_t* data, uint8_t size)
+{
+    return uart_rx_read(&uart1_rx, data, size);
+}
+
+uint8_t uart2_read(uint8_t* data, uint8_t size)
+{
+    return uart_rx_read(&uart2_rx, data, size);
+}
+
+uint8_t uart1_wait(uint8_t num_bytes, unsigned int timeout_ms)
+{
+    return uart_rx_wait(&uart1_rx, num_bytes, timeout_ms);
+}
+
+uint8_t uart2_wait(uint8_t num_bytes, unsigned int timeout_ms)
+{
+    return uart_rx_wait(&uart2_rx, num_bytes, timeout_ms);
+}
+
+unsigned int uart1_rx_overruns(void)
+{
+    return uart_rx_counter(&uart1_rx.overruns);
+}
+
+unsigned int uart2_rx_overruns(void)
+{
+    return uart_rx_counter(&uart2_rx.overruns);
+}
+
+unsigned int uart1_rx_frame_errors(void)
+{
+    return uart_rx_counter(&uart1_rx.frame_errors);
+}
+
+unsigned int uart2_rx_frame_errors(void)
+{
+    return uart_rx_counter(&uart2_rx.frame_errors);
 }
 
 /**
@@ -165,16 +479,32 @@ void uart2_reset_receive(void)
  */
 ISR(USART1_RX_vect)
 {
-	while(!(UCSR1A & (1<<RXC1)));
-    uart1_buffer[uart1_buffer_index] = UDR1;
-    uart1_buffer_index = (uart1_buffer_index + 1) % UART_BUFFER_SIZE;
+    uint8_t status = UCSR1A;
+    uart_rx_isr(&uart1_rx, status & (1<<FE1), status & (1<<DOR1), UDR1);
 }
 
 ISR(USART2_RX_vect)
 {
-	while(!(UCSR2A & (1<<RXC2)));
-    uart2_buffer[uart2_buffer_index] = UDR2;
-    uart2_buffer_index = (uart2_buffer_index + 1) % UART_BUFFER_SIZE;
+    uint8_t status = UCSR2A;
+    uart_rx_isr(&uart2_rx, status & (1<<FE2), status & (1<<DOR2), UDR2);
+}
+
+/**
+ * UART data register empty ISRs, only enabled while there is something to send
+ */
+ISR(USART0_UDRE_vect)
+{
+    uart_tx_isr(&uart0_tx);
+}
+
+ISR(USART1_UDRE_vect)
+{
+    uart_tx_isr(&uart1_tx);
+}
+
+ISR(USART2_UDRE_vect)
+{
+    uart_tx_isr(&uart2_tx);
 }
 
 void uart1_print(uint8_t* output, int size)
@@ -15,11 +15,14 @@
 #define MYBRR(baud_rate) (F_CPU / 16 / (baud_rate) - 1)
 #define BAUD_CALC(x) ((F_CPU+(x)*8UL) / (16UL*(x))-1UL)
 
-#define UART_BUFFER_SIZE    32
+#define UART1_RX_SIZE       32  // bytes received and not yet consumed, a power of two (max 128)
+#define UART2_RX_SIZE       32
+#define UART_TX_SIZE        64  // bytes queued for sending per port, a power of two (max 128)
 
 void uart0_init(void);
 void uart0_putc(char c, FILE *stream);
 char uart0_getc(FILE *stream);
+void uart0_flush(void);
 
 extern FILE uart0_output;
 extern FILE uart0_input;
@@ -37,14 +40,64 @@ void uart2_putc(char byte);
 void uart1_print(uint8_t* output, int size);
 void uart2_print(uint8_t* output, int size);
 
-void uart1_reset_receive(void);
-void uart2_reset_receive(void);
-
+/*
+ * Output is queued and sent by the UDRE interrupt. The putc and print
+ * functions above only wait when their port's queue is full.
+ * uartN_write() never waits: it queues as much of "data" as fits and
+ * returns how many bytes that was. uartN_send() queues all of it at once,
+ * waiting for room like putc, so a task writing the same port meanwhile
+ * can't split it; use it for device commands. size must be less than
+ * UART_TX_SIZE. uartN_tx_space() is how many bytes could be queued right now.
+ */
+uint8_t uart0_write(const uint8_t* data, uint8_t size);
+uint8_t uart1_write(const uint8_t* data, uint8_t size);
+uint8_t uart2_write(const uint8_t* data, uint8_t size);
+void uart0_send(const uint8_t* data, uint8_t size);
+void uart1_send(const uint8_t* data, uint8_t size);
+void uart2_send(const uint8_t* data, uint8_t size);
+uint8_t uart0_tx_space(void);
+uint8_t uart1_tx_space(void);
+uint8_t uart2_tx_space(void);
+
+/*
+ * Input is queued by the RX interrupt and stays queued until consumed, so
+ * nothing that arrives while a task is reading is lost. bytes_received()
+ * is how many are waiting, peek(i) the i-th of them (oldest is 0) without
+ * consuming it, consume(n) drops the oldest n, and read() copies out and
+ * consumes up to "size" of them, returning how many.
+ * Bytes that arrive with a framing error are dropped and counted; bytes
+ * that find the queue (or the hardware) full are lost and counted as
+ * overruns.
+ */
 uint8_t uart1_bytes_received(void);
 uint8_t uart2_bytes_received(void);
 
-uint8_t uart1_get_byte(int index);
-uint8_t uart2_get_byte(int index);
+uint8_t uart1_peek(uint8_t index);
+uint8_t uart2_peek(uint8_t index);
+
+void uart1_consume(uint8_t n);
+void uart2_consume(uint8_t n);
+
+uint8_t uart1_read(uint8_t* data, uint8_t size);
+uint8_t uart2_read(uint8_t* data, uint8_t size);
+
+/*
+ * Blocks the calling task until at least "num_bytes" are waiting or
+ * "timeout_ms" milliseconds have passed, letting other tasks run
+ * meanwhile. Returns whether the bytes are there. num_bytes must be
+ * less than the port's RX size.
+ * Only one task can wait on a port at a time: while one does, another
+ * that would have to wait gets FALSE straight away. Under PERIODIC_FIXED
+ * a periodic task waits at most until its wcet is up, whatever the
+ * timeout, see Task_Wait_Input().
+ */
+uint8_t uart1_wait(uint8_t num_bytes, unsigned int timeout_ms);
+uint8_t uart2_wait(uint8_t num_bytes, unsigned int timeout_ms);
+
+unsigned int uart1_rx_overruns(void);
+unsigned int uart2_rx_overruns(void);
+unsigned int uart1_rx_frame_errors(void);
+unsigned int uart2_rx_frame_errors(void);
 
 
 #endif
@@ -22,7 +22,7 @@ void query_joystick() {
         query_joystick_z(0);
         query_joystick_x(1);
         query_joystick_y(1);
-        _delay_ms(20);
+        Task_Sleep(20 / MSECPERTICK);
     }
 }
 
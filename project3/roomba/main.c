@@ -11,14 +11,22 @@
 uint8_t ambient_light;
 #define MAX_LIGHT_DIFF 20
 
+#define SMALL_STACK 128  // task stack sizes, see setup_tasks()
+#define MID_STACK   160
+
 roomba_sensor_data_t external;
 roomba_sensor_data_t chassis;
 roomba_sensor_data_t internal;
 
 uint8_t is_escaping = 0;
+uint8_t is_killed = 0;  // set once by Query_LightSensor, the robot stays stopped
+
+EVENT sensor_events;
+#define EXTERNAL_UPDATED 0x0001  // a new external sensor packet is in "external"
 
 uint8_t packet[6];
 uint8_t packet_index = 0;
+MUTEX packet_lock;  // packet[] is written by Read_Bluetooth, read by Set_Servo and Set_Roomba
 
 extern int pos_x;
 extern int pos_y;
@@ -27,6 +35,7 @@ void Roomba_UpdateSensorPacket_External() PERIODIC_TASK(
 {
 	BIT_SET(PORTA, 0);
 	Roomba_UpdateSensorPacket(EXTERNAL, &external);
+	Event_Set(sensor_events, EXTERNAL_UPDATED);
 	BIT_RESET(PORTA, 0);
 }
 )
@@ -45,19 +54,26 @@ void Roomba_UpdateSensorPacket_Internal() PERIODIC_TASK(
 
 void Roomba_ChangeMoveState() PERIODIC_TASK(
 {
+	if(is_killed) continue;  // Kill owns the LED
 	BIT_SET(PORTA, 1);
 	Roomba_ChangeDriveState();
 	BIT_RESET(PORTA, 1);
 }
 )
 
+/*
+ * Stops the robot for good; the drive and servo tasks see is_killed and
+ * leave it stopped while this blinks the LED
+ */
 void Kill() 
 {
+	Roomba_Drive(0, 0);
+	servo_set_laser(0);
 	for(;;) {
 		Roomba_ConfigPowerLED(POWER_RED, 255);
-		_delay_ms(500);
+		Task_Sleep(500 / MSECPERTICK);
 		Roomba_ConfigPowerLED(POWER_RED, 0);
-		_delay_ms(500);
+		Task_Sleep(500 / MSECPERTICK);
 	}
 }
 
@@ -65,9 +81,10 @@ void Query_LightSensor() PERIODIC_TASK(
 {
 	uint8_t val = analog_read(1);
 	//printf("%d\n", val);
-	if(val >= ambient_light*1.5)
+	if(!is_killed && val >= ambient_light*1.5)
 	{
-		Task_Create_System(Kill, 0);
+		is_killed = 1;
+		Task_Create(Kill, SYSTEM, 0, 0, 0, 0, OVERRUN_ABORT, 0, SMALL_STACK);
 	}
 }
 )
@@ -85,35 +102,41 @@ void Roomba_Escape()
   			_delay_ms(10);
 			Roomba_UpdateSensorPacket(CHASSIS, &chassis);
   		}*/
-		_delay_ms(250);
-  		Roomba_Drive(0, 0);
-		
-	Roomba_ConfigPowerLED(POWER_RED, 255);
+		Task_Sleep(250 / MSECPERTICK);
+		if(!is_killed) {
+  			Roomba_Drive(0, 0);
+			Roomba_ConfigPowerLED(POWER_RED, 255);
+		}
 	is_escaping = 0;
 }
 
-void Roomba_CheckEnvironment() PERIODIC_TASK(
+/*
+ * Runs each time Roomba_UpdateSensorPacket_External publishes a packet
+ */
+void Roomba_CheckEnvironment()
 {
-	BIT_SET(PORTA, 3);
-	if(Roomba_BumperActivated(&external) || Roomba_RiverHit(&external))
-	{
-		if(is_escaping == 0) {
-			is_escaping = 1;
-			Task_Create_System(Roomba_Escape, 0);
+	for(;;) {
+		Event_Wait(sensor_events, EXTERNAL_UPDATED, EVENT_ANY | EVENT_CLEAR);
+		BIT_SET(PORTA, 3);
+		if(Roomba_BumperActivated(&external) || Roomba_RiverHit(&external))
+		{
+			if(is_escaping == 0 && !is_killed) {
+				is_escaping = 1;
+				Task_Create(Roomba_Escape, SYSTEM, 0, 0, 0, 0, OVERRUN_ABORT, 0, SMALL_STACK);
+			}
 		}
+		BIT_RESET(PORTA, 3);
 	}
-	BIT_RESET(PORTA, 3);
 }
-)
 
 void Setup_Ambient_Light() {
 	ambient_light = 0;
-	_delay_ms(500);
+	Task_Sleep(500 / MSECPERTICK);
 	int i;
 	for(i = 0; i < 10; i++)
 	{
 		ambient_light += analog_read(1);
-		_delay_ms(100);
+		Task_Sleep(100 / MSECPERTICK);
 	}
 	ambient_light = ambient_light/10;
 	
@@ -123,26 +146,42 @@ void Setup_Ambient_Light() {
 void Read_Bluetooth() PERIODIC_TASK(
 {
 	uint8_t num_bytes = uart1_bytes_received();
+	uint8_t b;
 	int i;
+	Mutex_Lock(packet_lock);
 	for(i = 0; i < num_bytes; i++) {
-		if(uart1_get_byte(i) == 255)
+		b = uart1_peek(i);
+		if(b == 255)
 		{
 			packet_index = 0;
 		}
-		if(packet_index >= 6) break;
-		packet[packet_index] = uart1_get_byte(i);
-		packet_index++;
+		// anything past a full packet is dropped until the next 255
+		if(packet_index < 6) {
+			packet[packet_index] = b;
+			packet_index++;
+		}
 	}
+	Mutex_Unlock(packet_lock);
 	
-	uart1_reset_receive();
+	// only what was read; bytes that came in meanwhile wait for the next job
+	uart1_consume(num_bytes);
 }
 )
 
 void Set_Servo() PERIODIC_TASK(
 {
-	servo_set_pan(packet[1]);
-	servo_set_tilt(packet[2]);
-	servo_set_laser(packet[3]);
+	uint8_t pan;
+	uint8_t tilt;
+	uint8_t laser;
+	if(is_killed) continue;
+	Mutex_Lock(packet_lock);
+	pan = packet[1];
+	tilt = packet[2];
+	laser = packet[3];
+	Mutex_Unlock(packet_lock);
+	servo_set_pan(pan);
+	servo_set_tilt(tilt);
+	servo_set_laser(laser);
 }
 )
 
@@ -153,8 +192,16 @@ int abs(int v) {
 
 void Set_Roomba() PERIODIC_TASK(
 {
-	int vel = -map(packet[5], 0, 255, -350, 350);
-	int rad = map(packet[4], 0, 255, -2000, 2000);
+	uint8_t v;
+	uint8_t r;
+	// Roomba_Escape and Kill drive on their own meanwhile
+	if(is_escaping || is_killed) continue;
+	Mutex_Lock(packet_lock);
+	v = packet[5];
+	r = packet[4];
+	Mutex_Unlock(packet_lock);
+	int vel = -map(v, 0, 255, -350, 350);
+	int rad = map(r, 0, 255, -2000, 2000);
 	if(abs(vel) < 100) {
 		vel = 0;
 		
@@ -179,15 +226,26 @@ void setup_tasks()
 	servo_init();
 	uart1_init(BAUD_CALC(9600));
 	Setup_Ambient_Light();
+	// only periodic tasks use it. A PERIODIC ceiling costs nothing under
+	// PERIODIC_FIXED, where their slots never overlap, and under EDF/RM keeps
+	// the others from preempting the holder, as a periodic task must not wait
+	packet_lock = Mutex_Init(PERIODIC);
+	sensor_events = Event_Init();
 	
-	Task_Create_Period(Roomba_ChangeMoveState, 0, 6000, 2, 0);  // 0.5ms execution time
-	Task_Create_Period(Roomba_UpdateSensorPacket_External, 0, 25, 5, 5); // 14.5ms execution time*/
+	// Stacks: the full WORKSPACE only where printf can run, SMALL_STACK for tasks
+	// that only call the kernel and the Roomba/servo drivers, MID_STACK for those
+	// that also create a task or do float math
+	// a slow sensor packet only costs us one poll, not the whole robot
+	Task_Create(Roomba_UpdateSensorPacket_External, PERIODIC, 0, 25, 5, 5, OVERRUN_SKIP, 0, WORKSPACE); // 14.5ms execution time*/
 	//Task_Create_Period(Roomba_UpdateSensorPacket_Internal, 0, 25, 7, 550); // 0.55ms execution time
-	Task_Create_Period(Roomba_CheckEnvironment, 0, 25, 2, 10); // 0.27ms execution time
-	Task_Create_Period(Query_LightSensor, 0, 50, 2, 13); // 2.9us execution time
-	Task_Create_Period(Read_Bluetooth, 0, 25, 2, 16); // 0.6ms execution time
-	Task_Create_Period(Set_Roomba, 0, 25, 5, 20); // 4ms execution time
-	Task_Create_Period(Set_Servo, 0, 25, 2, 23); // 2.6us execution time
+	Task_Create(Roomba_CheckEnvironment, SYSTEM, 0, 0, 0, 0, OVERRUN_ABORT, 0, MID_STACK); // 0.27ms execution time, once per sensor packet
+	Task_Create(Query_LightSensor, PERIODIC, 0, 50, 2, 13, OVERRUN_ABORT, 0, MID_STACK); // 2.9us execution time
+	Task_Create(Read_Bluetooth, PERIODIC, 0, 25, 2, 16, OVERRUN_ABORT, 0, SMALL_STACK); // 0.6ms execution time
+	Task_Create(Set_Roomba, PERIODIC, 0, 25, 3, 20, OVERRUN_ABORT, 0, MID_STACK); // 4ms execution time
+	Task_Create(Set_Servo, PERIODIC, 0, 25, 2, 23, OVERRUN_ABORT, 0, SMALL_STACK); // 2.6us execution time
+	// Created last: with CYCLIC_EXECUTIVE the tasks above fit the table (50 tick
+	// hyperperiod) and this one, which would stretch it to 6000, uses the heap
+	Task_Create(Roomba_ChangeMoveState, PERIODIC, 0, 6000, 2, 0, OVERRUN_ABORT, 0, SMALL_STACK);  // 0.5ms execution time
 	
 }
 
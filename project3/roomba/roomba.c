@@ -78,73 +78,74 @@ void Roomba_Init()
 }
 
 /**
- * Use this function instead of the while loops in Roomba_UpdateSensorPacket if you have a system
- * clock.  This will add a timeout when it's waiting for the bytes to come in, so that the
- * function doesn't enter an infinite loop if a byte is missed.  You'll have to modify this function
- * and insert it into Roomba_UpdateSensorPacket to suit your application.
+ * Waits up to "timeout" milliseconds for the Roomba's reply, so that the function doesn't
+ * wait forever if a byte is missed. The task is blocked meanwhile and the RX interrupt
+ * wakes it, so other tasks run while the Roomba answers. Called from a periodic task
+ * under PERIODIC_FIXED, the wait also ends with the task's wcet.
  */
 
 uint8_t wait_for_bytes(uint8_t num_bytes, uint8_t timeout)
 {
-	uint16_t start;
-	start = Now();	// current system time
-	while (Now() - start < timeout && uart2_bytes_received() < num_bytes);
-	if (uart2_bytes_received() >= num_bytes)
-		return TRUE;
-	else
-		return FALSE;
+	return uart2_wait(num_bytes, timeout);
 }
 
 void Roomba_UpdateSensorPacket(ROOMBA_SENSOR_GROUP group, roomba_sensor_data_t* sensor_packet)
 {
-	uart2_reset_receive();
-	uart2_putc(SENSORS);
-	uart2_putc(group);
+	uint8_t size = 0;
+	uint8_t cmd[2];
+	// drop anything left over, e.g. the late end of a reply that timed out
+	uart2_consume(uart2_bytes_received());
+	cmd[0] = SENSORS;
+	cmd[1] = group;
+	uart2_send(cmd, 2);
 	switch(group)
 	{
 	case EXTERNAL:
 		// environment sensors
 		if(wait_for_bytes(10, 50) == FALSE) {printf("Failed\n"); break;}
 		//while (uart_bytes_received() != 10);
-		sensor_packet->bumps_wheeldrops = uart2_get_byte(0);
-		sensor_packet->wall = uart2_get_byte(1);
-		sensor_packet->cliff_left = uart2_get_byte(2);
-		sensor_packet->cliff_front_left = uart2_get_byte(3);
-		sensor_packet->cliff_front_right = uart2_get_byte(4);
-		sensor_packet->cliff_right = uart2_get_byte(5);
-		sensor_packet->virtual_wall = uart2_get_byte(6);
-		sensor_packet->motor_overcurrents = uart2_get_byte(7);
-		sensor_packet->dirt_left = uart2_get_byte(8);
-		sensor_packet->dirt_right = uart2_get_byte(9);
+		size = 10;
+		sensor_packet->bumps_wheeldrops = uart2_peek(0);
+		sensor_packet->wall = uart2_peek(1);
+		sensor_packet->cliff_left = uart2_peek(2);
+		sensor_packet->cliff_front_left = uart2_peek(3);
+		sensor_packet->cliff_front_right = uart2_peek(4);
+		sensor_packet->cliff_right = uart2_peek(5);
+		sensor_packet->virtual_wall = uart2_peek(6);
+		sensor_packet->motor_overcurrents = uart2_peek(7);
+		sensor_packet->dirt_left = uart2_peek(8);
+		sensor_packet->dirt_right = uart2_peek(9);
 		break;
 	case CHASSIS:
 		// chassis sensors
 		if(wait_for_bytes(6, 50) == FALSE) break;
 		//while (uart_bytes_received() != 6);
-		sensor_packet->remote_opcode = uart2_get_byte(0);
-		sensor_packet->buttons = uart2_get_byte(1);
-		sensor_packet->distance.bytes.high_byte = uart2_get_byte(2);
-		sensor_packet->distance.bytes.low_byte = uart2_get_byte(3);
-		sensor_packet->angle.bytes.high_byte = uart2_get_byte(4);
-		sensor_packet->angle.bytes.low_byte = uart2_get_byte(5);
+		size = 6;
+		sensor_packet->remote_opcode = uart2_peek(0);
+		sensor_packet->buttons = uart2_peek(1);
+		sensor_packet->distance.bytes.high_byte = uart2_peek(2);
+		sensor_packet->distance.bytes.low_byte = uart2_peek(3);
+		sensor_packet->angle.bytes.high_byte = uart2_peek(4);
+		sensor_packet->angle.bytes.low_byte = uart2_peek(5);
 		break;
 	case INTERNAL:
 		// internal sensors
 		if(wait_for_bytes(10, 50) == FALSE) break;
 		//while (uart_bytes_received() != 10);
-		sensor_packet->charging_state = uart2_get_byte(0);
-		sensor_packet->voltage.bytes.high_byte = uart2_get_byte(1);
-		sensor_packet->voltage.bytes.low_byte = uart2_get_byte(2);
-		sensor_packet->current.bytes.high_byte = uart2_get_byte(3);
-		sensor_packet->current.bytes.low_byte = uart2_get_byte(4);
-		sensor_packet->temperature = uart2_get_byte(5);
-		sensor_packet->charge.bytes.high_byte = uart2_get_byte(6);
-		sensor_packet->charge.bytes.low_byte = uart2_get_byte(7);
-		sensor_packet->capacity.bytes.high_byte = uart2_get_byte(8);
-		sensor_packet->capacity.bytes.low_byte = uart2_get_byte(9);
+		size = 10;
+		sensor_packet->charging_state = uart2_peek(0);
+		sensor_packet->voltage.bytes.high_byte = uart2_peek(1);
+		sensor_packet->voltage.bytes.low_byte = uart2_peek(2);
+		sensor_packet->current.bytes.high_byte = uart2_peek(3);
+		sensor_packet->current.bytes.low_byte = uart2_peek(4);
+		sensor_packet->temperature = uart2_peek(5);
+		sensor_packet->charge.bytes.high_byte = uart2_peek(6);
+		sensor_packet->charge.bytes.low_byte = uart2_peek(7);
+		sensor_packet->capacity.bytes.high_byte = uart2_peek(8);
+		sensor_packet->capacity.bytes.low_byte = uart2_peek(9);
 		break;
 	}
-	uart2_reset_receive();
+	uart2_consume(size);
 }
 
 void Roomba_ChangeState(ROOMBA_STATE newState)
@@ -175,29 +176,33 @@ void Roomba_ChangeState(ROOMBA_STATE newState)
 	_delay_ms(20);
 }
 
+/*
+ * Commands go out with uart2_send(), whole, since the drive tasks and
+ * Kill/Roomba_Escape can preempt each other in the middle of one
+ */
 void Roomba_D_Drive(int16_t left, int16_t right)
 {
-	uart2_putc(D_DRIVE);
-	uart2_putc(HIGH_BYTE(left));
-	uart2_putc(LOW_BYTE(left));
-	uart2_putc(HIGH_BYTE(right));
-	uart2_putc(LOW_BYTE(right));
+	uint8_t cmd[5] = { D_DRIVE, HIGH_BYTE(left), LOW_BYTE(left), HIGH_BYTE(right), LOW_BYTE(right) };
+
+	uart2_send(cmd, 5);
 }
 
 void Roomba_Drive( int16_t velocity, int16_t radius )
 {
-	uart2_putc(DRIVE);
-	
+	uint8_t cmd[5];
+
 	if(m_state == STAND_MODE) 
 	{
 		velocity = 0;
 		radius = (radius > 0) ? 1 : -1;
 	}
 	
-	uart2_putc(HIGH_BYTE(velocity));
-	uart2_putc(LOW_BYTE(velocity));
-	uart2_putc(HIGH_BYTE(radius));
-	uart2_putc(LOW_BYTE(radius));
+	cmd[0] = DRIVE;
+	cmd[1] = HIGH_BYTE(velocity);
+	cmd[2] = LOW_BYTE(velocity);
+	cmd[3] = HIGH_BYTE(radius);
+	cmd[4] = LOW_BYTE(radius);
+	uart2_send(cmd, 5);
 }
 
 /**
@@ -208,10 +213,9 @@ void update_leds()
 	// The status, spot, clean, max, and dirt detect LED states are combined in a single byte.
 	uint8_t leds = status << 4 | spot << 3 | clean << 2 | max << 1 | dd;
 
-	uart2_putc(LEDS);
-	uart2_putc(leds);
-	uart2_putc(power_colour);
-	uart2_putc(power_intensity);
+	uint8_t cmd[4] = { LEDS, leds, power_colour, power_intensity };
+
+	uart2_send(cmd, 4);
 }
 
 void Roomba_ConfigPowerLED(uint8_t colour, uint8_t intensity)
@@ -268,8 +272,9 @@ void Roomba_LoadSong(uint8_t songNum, uint8_t* notes, uint8_t* notelengths, uint
 
 void Roomba_PlaySong(int songNum)
 {
-	uart2_putc(PLAY);
-	uart2_putc(songNum);
+	uint8_t cmd[2] = { PLAY, songNum };
+
+	uart2_send(cmd, 2);
 }
 
 void Roomba_ChangeDriveState() 